@@ -0,0 +1,90 @@
+/*
+ * nuvoboot, UART ISP bootloader for the Nuvoton N76E003 LDROM
+ * https://github.com/steve-m/N76E003-playground
+ *
+ * Copyright (c) 2021 Steve Markgraf <steve@steve-m.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef N76E003_H
+#define N76E003_H
+
+/* the subset of N76E003 SFRs used by the bootloader, SDCC syntax */
+
+__sfr __at (0x84) RCTRIM0;
+__sfr __at (0x85) RCTRIM1;
+__sfr __at (0x87) PCON;
+__sfr __at (0x88) TCON;
+__sfr __at (0x89) TMOD;
+__sfr __at (0x8a) TL0;
+__sfr __at (0x8c) TH0;
+__sfr __at (0x8d) TH1;
+__sfr __at (0x98) SCON;
+__sfr __at (0x99) SBUF;
+__sfr __at (0x9f) CHPCON;
+__sfr __at (0xa4) IAPTRG;
+__sfr __at (0xa5) IAPUEN;
+__sfr __at (0xa6) IAPAL;
+__sfr __at (0xa7) IAPAH;
+__sfr __at (0xa8) IE;
+__sfr __at (0xae) IAPFD;
+__sfr __at (0xaf) IAPCN;
+__sfr __at (0xb1) P0M1;
+__sfr __at (0xb2) P0M2;
+__sfr __at (0xc4) T3CON;
+__sfr __at (0xc5) RL3;
+__sfr __at (0xc6) RH3;
+__sfr __at (0xc7) TA;
+
+__sbit __at (0x8c) TR0;
+__sbit __at (0x8d) TF0;
+__sbit __at (0x8e) TR1;
+__sbit __at (0x98) RI;
+__sbit __at (0x99) TI;
+
+/* CHPCON, IAPUEN and IAPTRG are behind timed access */
+#define TA_UNLOCK()		do { TA = 0xaa; TA = 0x55; } while (0)
+
+#define CHPCON_IAPEN		0x01
+#define CHPCON_BS		0x02
+#define CHPCON_SWRST		0x80
+
+#define IAPUEN_APUEN		0x01
+#define IAPUEN_CFUEN		0x04
+
+#define IAPTRG_IAPGO		0x01
+
+#define T3CON_TR3		0x08
+#define T3CON_BRCK		0x20
+
+#define PCON_SMOD		0x80
+
+/* IAPCN commands */
+#define IAP_READ_APROM		0x00
+#define IAP_READ_UID		0x04
+#define IAP_READ_DID		0x0c
+#define IAP_PROGRAM_APROM	0x21
+#define IAP_ERASE_APROM		0x22
+#define IAP_READ_CONFIG		0xc0
+#define IAP_PROGRAM_CONFIG	0xe1
+#define IAP_ERASE_CONFIG	0xe2
+
+#endif
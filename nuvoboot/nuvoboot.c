@@ -0,0 +1,694 @@
+/*
+ * nuvoboot, UART ISP bootloader for the Nuvoton N76E003 LDROM
+ * https://github.com/steve-m/N76E003-playground
+ *
+ * Copyright (c) 2021 Steve Markgraf <steve@steve-m.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Drop-in replacement for Nuvoton's ldrom_isp_bootloader.bin, it speaks
+ * the same 64 byte packet protocol used by nuvoispy and 'nuvoicp -i':
+ * every request is answered with the 16 bit sum of the request in bytes
+ * 0-1 and the incremented packet number in bytes 4-7.
+ *
+ * Extensions, announced by CMD_GET_CAPS (stock bootloaders don't reply):
+ *
+ * CMD_GET_CAPS		[8] protocol version, [9] stream payload size,
+ *			[10] stream window, [11] bitmask of supported bauds,
+ *			[12] bitmask of optional commands (CAP_*)
+ * CMD_SET_BAUD		[8..11] baud rate; the reply goes out at the old rate,
+ *			[8] 0 if accepted, [9] stream window at the new rate.
+ *			Falls back to 115200 if nothing valid arrives within
+ *			about one second.
+ * CMD_ERASE		[8..11] address, [12..15] length, erases whole pages
+ *			and restarts the stream sequence at 0
+ * CMD_CRC32		[8..11] address, [12..15] length, replies with the
+ *			CRC-32 (IEEE 802.3, as zlib) of that range in [8..11]
+ * CMD_WRITE		[8..11] address, [12] length of up to 48 bytes,
+ *			[16..63] data, programs already erased flash
+ * CMD_PAGE_CRCS	[8] first page, [9] number of pages (up to 14),
+ *			replies with the CRC-32 of each page from [8] on
+ * CMD_READ		[8..11] address, [12] length of up to 56 bytes,
+ *			replies with the APROM content from [8] on
+ * CMD_STREAM_DATA	a 134 byte frame instead of a 64 byte packet:
+ *			[0] cmd, [1] seq, [2..3] page address,
+ *			[4..131] page data, [132..133] 16 bit sum of [0..131]
+ *
+ * CMD_STREAM_LZ		a compressed stream frame of 7 + n bytes:
+ *			[0] cmd, [1] seq, [2..3] page address, [4] n,
+ *			[5..] n bytes of tokens, then the 16 bit sum.
+ *			Tokens, decoded straight into the erased page:
+ *			0x00-0x7f: c + 1 literal bytes follow
+ *			0x80-0xbf: (c & 0x3f) + 3 times the next byte
+ *			0xc0-0xff: (c & 0x3f) + 3 bytes copied from the next
+ *			byte's distance back within the same page
+ *
+ * Requests whose address range reaches past the end of APROM are not
+ * answered, like unknown commands.
+ *
+ * Stream frames are acknowledged cumulatively with four bytes:
+ * [0] CMD_STREAM_DATA, [1] seq of the last programmed frame, [2] status,
+ * [3] xor of [0..2]. The host may have 'window' frames in flight; after
+ * an error the bootloader ignores everything until the line has been idle
+ * for a frame gap and the host resends from the acknowledged frame on.
+ *
+ * There are no interrupts, the UART is polled into a ring buffer between
+ * IAP operations. The CPU halts during each IAP operation, which only
+ * leaves time for the two byte UART buffer at 1 Mbaud, so the window is 1
+ * there.
+ *
+ * Status: this image has not been built or run yet, neither on a board
+ * nor in a simulator. Run 'make test' (sdcc, ucsim's s51 and socat)
+ * before flashing it: it fails if the code outgrows the 2 KB LDROM or the
+ * variables the 768 bytes of XRAM, then programs a -DSIM build under s51
+ * with nuvoispy, stock updates, streaming, LZ frames and read back.
+ */
+
+#include <stdint.h>
+
+#include "n76e003.h"
+
+#define FW_VERSION		0x81	/* bit 7 tells hosts this is nuvoboot */
+#define PROTO_VERSION		1
+
+#define FLASH_SIZE		(18 * 1024)
+#define PAGE_SIZE		128
+#define PACKSIZE		64
+
+#define CMD_UPDATE_APROM	0xa0
+#define CMD_UPDATE_CONFIG	0xa1
+#define CMD_READ_CONFIG		0xa2
+#define CMD_SYNC_PACKNO		0xa4
+#define CMD_GET_FWVER		0xa6
+#define CMD_RUN_APROM		0xab
+#define CMD_CONNECT		0xae
+#define CMD_GET_DEVICEID	0xb1
+
+#define CMD_GET_CAPS		0xd0
+#define CMD_SET_BAUD		0xd1
+#define CMD_ERASE		0xd2
+#define CMD_STREAM_DATA		0xd3
+#define CMD_CRC32		0xd4
+#define CMD_WRITE		0xd5
+#define CMD_PAGE_CRCS		0xd6
+#define CMD_STREAM_LZ		0xd7
+#define CMD_READ		0xd8
+
+#define CAP_CRC32		0x01
+#define CAP_PAGES		0x02	/* CMD_WRITE and CMD_PAGE_CRCS */
+#define CAP_LZ			0x04
+#define CAP_READ		0x08
+
+#define MAX_PAGE_CRCS		((PACKSIZE - 8) / 4)
+#define READ_LEN		(PACKSIZE - 8)
+
+#define STREAM_FRAME_SIZE	(4 + PAGE_SIZE + 2)
+#define STREAM_WINDOW		3
+
+#define STREAM_OK		0
+#define STREAM_BAD_SUM		1
+#define STREAM_BAD_SEQ		2
+#define STREAM_BAD_ADDR		3
+#define STREAM_BAD_DATA		4
+
+#define LZ_HEADER_SIZE		5
+#define LZ_MAX_DATA		(STREAM_FRAME_SIZE - LZ_HEADER_SIZE - 2)
+
+/* Timer0 at Fsys/12 overflows every ~49 ms, the frame gap */
+#define LISTEN_TICKS		6	/* wait for CMD_CONNECT before running APROM */
+#define PROBATION_TICKS		20	/* fall back to 115200 after a bad baud switch */
+
+#define RING_SIZE		512	/* holds a full stream window */
+
+#define CFG_LEN			5
+
+enum baud {
+	BAUD_115200,	/* HIRC trimmed to 16.6 MHz */
+	BAUD_250000,	/* exact with HIRC at 16 MHz */
+	BAUD_500000,
+	BAUD_1000000,
+	BAUD_NUM
+};
+
+static const uint32_t baud_rates[BAUD_NUM] = {
+	115200, 250000, 500000, 1000000
+};
+
+/* Timer3 reload, baud = Fsys / 16 / (65536 - reload) */
+static const uint16_t baud_reload[BAUD_NUM] = {
+	65536 - 9, 65536 - 4, 65536 - 2, 65536 - 1
+};
+
+/* CRC-32 a nibble at a time, a 1 KB table would not fit the LDROM */
+static const uint32_t crc_nibble[16] = {
+	0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+	0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+	0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+	0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+};
+
+static __xdata uint8_t ring[RING_SIZE];
+static __xdata uint8_t rx[STREAM_FRAME_SIZE];
+static __xdata uint8_t tx[PACKSIZE];
+
+static uint16_t ring_head, ring_tail;
+static uint8_t hirc_trim0, hirc_trim1;
+static uint16_t aprom_end;
+static uint16_t update_addr, update_end;
+static uint8_t connected, window, stream_seq, probation;
+
+static void uart_poll(void)
+{
+	if (RI) {
+		RI = 0;
+		ring[ring_head] = SBUF;
+		ring_head = (ring_head + 1) & (RING_SIZE - 1);
+
+		/* restart the frame gap timer */
+		TL0 = 0;
+		TH0 = 0;
+		TF0 = 0;
+	}
+}
+
+/* next received byte, or -1 once the line has been idle for a frame gap */
+static int16_t uart_getc(void)
+{
+	uint8_t c;
+
+	while (ring_head == ring_tail) {
+		uart_poll();
+		if (TF0)
+			return -1;
+	}
+
+	c = ring[ring_tail];
+	ring_tail = (ring_tail + 1) & (RING_SIZE - 1);
+
+	return c;
+}
+
+static void uart_putc(uint8_t c)
+{
+	TI = 0;
+	SBUF = c;
+	while (!TI)
+		uart_poll();
+}
+
+#ifdef SIM
+/* s51 has no IAP, 'make test' keeps APROM and CONFIG in XRAM instead */
+static __xdata __at (0x1000) uint8_t sim_flash[FLASH_SIZE];
+static __xdata uint8_t sim_config[CFG_LEN];
+
+static uint8_t iap(uint8_t cmd, uint16_t addr, uint8_t dat)
+{
+	uint8_t i;
+
+	switch (cmd) {
+	case IAP_READ_APROM:
+		dat = sim_flash[addr];
+		break;
+	case IAP_READ_DID:
+		dat = addr ? 0x36 : 0x50;
+		break;
+	case IAP_PROGRAM_APROM:
+		sim_flash[addr] &= dat;
+		break;
+	case IAP_ERASE_APROM:
+		for (i = 0; i < PAGE_SIZE; i++)
+			sim_flash[addr + i] = 0xff;
+		break;
+	case IAP_READ_CONFIG:
+		dat = sim_config[addr];
+		break;
+	case IAP_PROGRAM_CONFIG:
+		sim_config[addr] &= dat;
+		break;
+	case IAP_ERASE_CONFIG:
+		for (i = 0; i < CFG_LEN; i++)
+			sim_config[i] = 0xff;
+		break;
+	}
+
+	uart_poll();
+
+	return dat;
+}
+
+/* an erased chip with a 2 KB LDROM */
+static void sim_erased(void)
+{
+	uint16_t addr;
+
+	for (addr = 0; addr < FLASH_SIZE; addr++)
+		sim_flash[addr] = 0xff;
+	iap(IAP_ERASE_CONFIG, 0, 0xff);
+	sim_config[1] = 0xfd;
+}
+#else
+static uint8_t iap(uint8_t cmd, uint16_t addr, uint8_t dat)
+{
+	IAPCN = cmd;
+	IAPAH = addr >> 8;
+	IAPAL = addr;
+	IAPFD = dat;
+	TA_UNLOCK();
+	IAPTRG |= IAPTRG_IAPGO;
+
+	/* the CPU was halted, pick up what arrived in the meantime */
+	uart_poll();
+
+	return IAPFD;
+}
+#endif
+
+/* HIRC at its factory 16 MHz trim, or 16.6 MHz like Nuvoton's BSP */
+static void hirc_set(uint8_t fast)
+{
+	uint16_t trim = (hirc_trim0 << 1) | (hirc_trim1 & 0x01);
+
+	if (fast)
+		trim -= 15;
+
+	TA_UNLOCK();
+	RCTRIM0 = trim >> 1;
+	TA_UNLOCK();
+	RCTRIM1 = trim & 0x01;
+}
+
+static void uart_baud(uint8_t b)
+{
+	hirc_set(b == BAUD_115200);
+	RH3 = baud_reload[b] >> 8;
+	RL3 = baud_reload[b] & 0xff;
+	window = b == BAUD_1000000 ? 1 : STREAM_WINDOW;
+}
+
+static void run_aprom(void)
+{
+	TA_UNLOCK();
+	CHPCON &= ~CHPCON_BS;
+	TA_UNLOCK();
+	CHPCON |= CHPCON_SWRST;
+}
+
+static void erase(uint16_t addr, uint16_t end)
+{
+	for (addr &= ~(PAGE_SIZE - 1); addr < end; addr += PAGE_SIZE)
+		iap(IAP_ERASE_APROM, addr, 0xff);
+}
+
+/* continue the legacy CMD_UPDATE_APROM stream */
+static void program(__xdata uint8_t *src, uint8_t len)
+{
+	while (len-- && update_addr < update_end)
+		iap(IAP_PROGRAM_APROM, update_addr++, *src++);
+}
+
+static uint16_t le16(__xdata uint8_t *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t le32(__xdata uint8_t *p)
+{
+	return le16(p) | ((uint32_t)le16(p + 2) << 16);
+}
+
+/* a range from the host, the 32 bit fields must not wrap past APROM */
+static uint8_t in_aprom(uint32_t addr, uint32_t len)
+{
+	return addr <= aprom_end && len <= aprom_end - addr;
+}
+
+static void put32(__xdata uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static uint32_t crc32(uint16_t addr, uint16_t end)
+{
+	uint32_t crc = 0xffffffff;
+
+	for (; addr < end; addr++) {
+		crc ^= iap(IAP_READ_APROM, addr, 0);
+		crc = (crc >> 4) ^ crc_nibble[crc & 0x0f];
+		crc = (crc >> 4) ^ crc_nibble[crc & 0x0f];
+	}
+
+	return ~crc;
+}
+
+/* receive one packet or stream frame, returns 0 on a frame gap */
+static uint8_t read_frame(void)
+{
+	uint8_t i, len = PACKSIZE;
+	int16_t c;
+
+	for (i = 0; i < len; i++) {
+		c = uart_getc();
+		if (c < 0) {
+			TF0 = 0;
+			return 0;
+		}
+
+		rx[i] = c;
+		if (!connected)
+			continue;
+
+		if (!i && c == CMD_STREAM_DATA)
+			len = STREAM_FRAME_SIZE;
+		else if (!i && c == CMD_STREAM_LZ)
+			len = LZ_HEADER_SIZE;
+		else if (i == LZ_HEADER_SIZE - 1 && rx[0] == CMD_STREAM_LZ)
+			len = LZ_HEADER_SIZE + (c > LZ_MAX_DATA ? LZ_MAX_DATA : c) + 2;
+	}
+
+	return len;
+}
+
+static void reply(void)
+{
+	uint16_t sum = 0;
+	uint8_t i, carry = 1;
+
+	for (i = 0; i < PACKSIZE; i++)
+		sum += rx[i];
+
+	tx[0] = sum;
+	tx[1] = sum >> 8;
+
+	/* 32 bit packet number + 1 */
+	for (i = 4; i < 8; i++) {
+		tx[i] = rx[i] + carry;
+		carry = carry && !tx[i];
+	}
+
+	for (i = 0; i < PACKSIZE; i++) {
+		uart_putc(tx[i]);
+		tx[i] = 0;
+	}
+}
+
+static void lz_put(uint16_t addr, uint8_t b)
+{
+	/* the page is erased, 0xff needs no programming */
+	if (b != 0xff)
+		iap(IAP_PROGRAM_APROM, addr, b);
+}
+
+/* decode a CMD_STREAM_LZ frame into flash, returns 0 on malformed tokens */
+static uint8_t lz_page(uint16_t addr)
+{
+	__xdata uint8_t *src = &rx[LZ_HEADER_SIZE];
+	__xdata uint8_t *end = src + rx[4];
+	uint8_t pos = 0, c, n, v;
+
+	while (src < end) {
+		c = *src++;
+
+		if (c < 0x80) {
+			n = c + 1;
+			if (n > end - src || n > PAGE_SIZE - pos)
+				return 0;
+			while (n--)
+				lz_put(addr + pos++, *src++);
+			continue;
+		}
+
+		n = (c & 0x3f) + 3;
+		if (src == end || n > PAGE_SIZE - pos)
+			return 0;
+		v = *src++;
+
+		if (c < 0xc0) {
+			while (n--)
+				lz_put(addr + pos++, v);
+		} else {
+			if (!v || v > pos)
+				return 0;
+			for (; n; n--, pos++)
+				lz_put(addr + pos, iap(IAP_READ_APROM, addr + pos - v, 0));
+		}
+	}
+
+	return 1;
+}
+
+static void stream_frame(uint8_t len)
+{
+	uint16_t sum = 0, addr = le16(&rx[2]);
+	uint8_t i, status = STREAM_OK;
+
+	for (i = 0; i < len - 2; i++)
+		sum += rx[i];
+
+	if (sum != le16(&rx[len - 2]))
+		status = STREAM_BAD_SUM;
+	else if (rx[1] != stream_seq)
+		status = STREAM_BAD_SEQ;
+	else if ((addr & (PAGE_SIZE - 1)) || addr >= aprom_end)
+		status = STREAM_BAD_ADDR;
+	else if (rx[0] == CMD_STREAM_LZ && !lz_page(addr))
+		status = STREAM_BAD_DATA;
+	else {
+		if (rx[0] == CMD_STREAM_DATA)
+			for (i = 0; i < PAGE_SIZE; i++)
+				iap(IAP_PROGRAM_APROM, addr + i, rx[4 + i]);
+		stream_seq++;
+		probation = 0;
+	}
+
+	i = stream_seq - 1;
+	uart_putc(CMD_STREAM_DATA);
+	uart_putc(i);
+	uart_putc(status);
+	uart_putc(CMD_STREAM_DATA ^ i ^ status);
+
+	/* drop the rest of the window, the host resends after the gap */
+	if (status != STREAM_OK)
+		while (uart_getc() >= 0)
+			;
+	TF0 = 0;
+}
+
+static void set_baud(void)
+{
+	uint32_t rate = le32(&rx[8]);
+	uint8_t b;
+
+	for (b = 0; b < BAUD_NUM; b++)
+		if (baud_rates[b] == rate)
+			break;
+
+	tx[8] = b == BAUD_NUM;
+	tx[9] = b == BAUD_1000000 ? 1 : STREAM_WINDOW;
+	reply();
+
+	if (b < BAUD_NUM) {
+		/* let the stop bit of the last byte go out */
+		for (rate = 0; rate < 200; rate++)
+			uart_poll();
+
+		uart_baud(b);
+		probation = b != BAUD_115200;
+	}
+}
+
+static void handle(void)
+{
+	uint16_t addr;
+	uint8_t i, n;
+
+	if (!connected && rx[0] != CMD_CONNECT)
+		return;
+
+	switch (rx[0]) {
+	case CMD_CONNECT:
+		connected = 1;
+		update_end = 0;
+		break;
+	case CMD_SYNC_PACKNO:
+		break;
+	case CMD_GET_FWVER:
+		tx[8] = FW_VERSION;
+		break;
+	case CMD_GET_DEVICEID:
+		tx[8] = iap(IAP_READ_DID, 0, 0);
+		tx[9] = iap(IAP_READ_DID, 1, 0);
+		break;
+	case CMD_READ_CONFIG:
+		for (i = 0; i < CFG_LEN; i++)
+			tx[8 + i] = iap(IAP_READ_CONFIG, i, 0);
+		tx[13] = tx[14] = tx[15] = 0xff;
+		break;
+	case CMD_UPDATE_CONFIG:
+		iap(IAP_ERASE_CONFIG, 0, 0xff);
+		for (i = 0; i < CFG_LEN; i++)
+			tx[8 + i] = iap(IAP_PROGRAM_CONFIG, i, rx[8 + i]);
+		break;
+	case CMD_UPDATE_APROM:
+		if (!in_aprom(le32(&rx[8]), le32(&rx[12])))
+			return;
+		update_addr = le16(&rx[8]);
+		update_end = update_addr + le16(&rx[12]);
+		erase(update_addr, update_end);
+		program(&rx[16], PACKSIZE - 16);
+		break;
+	case CMD_RUN_APROM:
+		run_aprom();
+		return;
+	case CMD_GET_CAPS:
+		tx[8] = PROTO_VERSION;
+		tx[9] = PAGE_SIZE;
+		tx[10] = window;
+		tx[11] = (1 << BAUD_NUM) - 1;
+		tx[12] = CAP_CRC32 | CAP_PAGES | CAP_LZ | CAP_READ;
+		break;
+	case CMD_SET_BAUD:
+		set_baud();
+		return;
+	case CMD_ERASE:
+		if (!in_aprom(le32(&rx[8]), le32(&rx[12])))
+			return;
+		addr = le16(&rx[8]);
+		erase(addr, addr + le16(&rx[12]));
+		stream_seq = 0;
+		break;
+	case CMD_CRC32:
+		if (!in_aprom(le32(&rx[8]), le32(&rx[12])))
+			return;
+		addr = le16(&rx[8]);
+		put32(&tx[8], crc32(addr, addr + le16(&rx[12])));
+		break;
+	case CMD_WRITE:
+		/* a one-off update range, continuation packets don't apply */
+		n = rx[12] > PACKSIZE - 16 ? PACKSIZE - 16 : rx[12];
+		if (!in_aprom(le32(&rx[8]), n))
+			return;
+		update_addr = le16(&rx[8]);
+		update_end = update_addr + n;
+		program(&rx[16], PACKSIZE - 16);
+		update_end = update_addr;
+		break;
+	case CMD_PAGE_CRCS:
+		n = rx[9] > MAX_PAGE_CRCS ? MAX_PAGE_CRCS : rx[9];
+		addr = rx[8] * PAGE_SIZE;
+		if (!in_aprom(addr, n * PAGE_SIZE))
+			return;
+		for (i = 0; i < n; i++, addr += PAGE_SIZE)
+			put32(&tx[8 + i * 4], crc32(addr, addr + PAGE_SIZE));
+		break;
+	case CMD_READ:
+		n = rx[12] > READ_LEN ? READ_LEN : rx[12];
+		if (!in_aprom(le32(&rx[8]), n))
+			return;
+		addr = le16(&rx[8]);
+		for (i = 0; i < n; i++, addr++)
+			tx[8 + i] = iap(IAP_READ_APROM, addr, 0);
+		break;
+	case 0:
+		/* continuation of CMD_UPDATE_APROM, padding after the end is ignored */
+		program(&rx[8], PACKSIZE - 8);
+		break;
+	default:
+		/* like the stock bootloader, unknown commands get no reply */
+		return;
+	}
+
+	probation = 0;
+	reply();
+}
+
+void main(void)
+{
+	uint8_t idle = 0, ldsize, len;
+
+#ifdef SIM
+	sim_erased();
+#endif
+
+	TA_UNLOCK();
+	CHPCON |= CHPCON_IAPEN;
+	TA_UNLOCK();
+	IAPUEN |= IAPUEN_APUEN | IAPUEN_CFUEN;
+
+	/* factory 16 MHz HIRC trim */
+	hirc_trim0 = iap(IAP_READ_UID, 0x30, 0);
+	hirc_trim1 = iap(IAP_READ_UID, 0x31, 0);
+
+	/* LDSIZE in CONFIG1: 7 - n KB of LDROM, at most 4 KB */
+	ldsize = 7 - (iap(IAP_READ_CONFIG, 1, 0) & 0x07);
+	aprom_end = FLASH_SIZE - (ldsize > 4 ? 4 : ldsize) * 1024;
+
+	/* P0.6 TXD quasi-bidirectional, P0.7 RXD input */
+	P0M1 &= ~0x40;
+	P0M2 &= ~0x40;
+
+	/* UART0 mode 1 clocked by Timer3 */
+	SCON = 0x50;
+	PCON |= PCON_SMOD;
+	T3CON = T3CON_BRCK | T3CON_TR3;
+	uart_baud(BAUD_115200);
+
+	/* Timer0 mode 1 as the frame gap timer */
+	TMOD = 0x01;
+	TR0 = 1;
+
+#ifdef SIM
+	/* no Timer3 either, Timer1 in mode 2 clocks the UART without SMOD,
+	 * Fosc / 384 = 115200 baud at the 44.2368 MHz the Makefile runs s51 at */
+	PCON &= ~PCON_SMOD;
+	TMOD = 0x21;
+	TH1 = 0xff;
+	TR1 = 1;
+#endif
+
+	while (1) {
+		if ((len = read_frame())) {
+			idle = 0;
+
+			if (connected && (rx[0] == CMD_STREAM_DATA || rx[0] == CMD_STREAM_LZ))
+				stream_frame(len);
+			else
+				handle();
+			continue;
+		}
+
+		if (idle < 0xff)
+			idle++;
+
+		/* no host, start the application if there is one */
+		if (!connected && idle >= LISTEN_TICKS &&
+		    iap(IAP_READ_APROM, 0, 0) != 0xff)
+			run_aprom();
+
+		if (probation && idle >= PROBATION_TICKS) {
+			uart_baud(BAUD_115200);
+			probation = 0;
+		}
+	}
+}
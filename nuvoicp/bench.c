@@ -0,0 +1,533 @@
+/*
+ * nuvoicp, a RPi ICP flasher for the Nuvoton N76E003
+ * https://github.com/steve-m/N76E003-playground
+ *
+ * Copyright (c) 2021 Steve Markgraf <steve@steve-m.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Benchmarks of the programming engines, run by 'make bench': ICP against
+ * the simulated target with each cost model, ISP against the bootloader
+ * emulator nuvoispy/ispemu.py or a real board. The results are JSON on
+ * stdout with a fixed set of keys, to be compared between builds.
+ *
+ * ICP figures are taken from the virtual clock of the simulated target
+ * and are exactly reproducible; "host" figures are the wall time the
+ * engine itself takes with the 'ideal' cost model, the median of several
+ * runs. ISP figures are wall time against a link paced at the baud rate.
+ *
+ * Programming rates are in image bytes, so the sparse image shows what
+ * skipping its erased pages saves. ISP has no sparse figure, the stock
+ * update sends every byte, and reads APROM back only as a CRC-32.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include "nuvoicp.h"
+#include "libnuvoprog.h"
+
+#define BENCH_VERSION	1
+
+#define BENCH_WORDS	4096	/* 24-bit words for the raw bit rate */
+#define BENCH_CMDS	1024
+#define BENCH_JOB_LEN	1024	/* APROM image of a programming job */
+#define SPARSE_EVERY	8	/* one page in this many used in the sparse image */
+
+static const char *cost_models[] = { "gpiod", "gpiomem", "ideal" };
+
+static int verbose, runs = 5;
+static int saved_stderr = -1;
+
+/* the engine logs to stderr, which would drown the results */
+static void quiet(int on)
+{
+	int fd;
+
+	if (verbose)
+		return;
+
+	if (on && saved_stderr < 0) {
+		fflush(stderr);
+		saved_stderr = dup(2);
+		if ((fd = open("/dev/null", O_WRONLY)) >= 0) {
+			dup2(fd, 2);
+			close(fd);
+		}
+	} else if (!on && saved_stderr >= 0) {
+		fflush(stderr);
+		dup2(saved_stderr, 2);
+		close(saved_stderr);
+		saved_stderr = -1;
+	}
+}
+
+static uint64_t wall_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static double rate(uint64_t count, uint64_t ns)
+{
+	return ns ? count * 1e9 / ns : 0;
+}
+
+/* null if nothing was measured, e.g. lines that cost nothing in the 'ideal' model */
+static void print_rate(const char *indent, const char *key, uint64_t count, uint64_t ns)
+{
+	if (ns)
+		printf("%s\"%s\": %.1f,\n", indent, key, rate(count, ns));
+	else
+		printf("%s\"%s\": null,\n", indent, key);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t median(uint64_t *v, int n)
+{
+	qsort(v, n, sizeof(*v), cmp_u64);
+	return v[n / 2];
+}
+
+/* the same images on every run: random data, all of it or every SPARSE_EVERY-th page */
+static void make_image(uint8_t *buf, uint32_t len, int sparse)
+{
+	uint64_t x = 0x9e3779b97f4a7c15ULL;
+
+	memset(buf, 0xff, len);
+
+	for (uint32_t i = 0; i < len; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+
+		if (!sparse || (i / PAGE_SIZE) % SPARSE_EVERY == 0)
+			buf[i] = x >> 32;
+	}
+}
+
+/* virtual time of the simulated target and wall time of the host */
+struct span {
+	uint64_t ns, wall_ns;
+};
+
+static uint64_t span_start, span_wall_start;
+
+static void span_begin(void)
+{
+	span_start = time_ns();
+	span_wall_start = wall_ns();
+}
+
+static void span_end(struct span *s)
+{
+	s->ns = time_ns() - span_start;
+	s->wall_ns = wall_ns() - span_wall_start;
+}
+
+struct icp_result {
+	const char *status;
+	struct span bits, cmds, read;
+	struct span dense, sparse;
+	struct span full_write, full_read;
+	struct span job;
+};
+
+static void program_plan(struct flash_plan *p, const uint8_t *image, uint32_t len)
+{
+	plan_init(p);
+	plan_set_aprom(p, image, len);
+	plan_layout(p, icp_dev);
+}
+
+/* one pass over everything with the current cost model */
+static void bench_icp(struct icp_result *r, const struct nuvo_device *dev)
+{
+	static struct flash_plan plan;
+	static uint8_t image[FLASH_MAX_SIZE], data[FLASH_MAX_SIZE];
+	struct nvp_segment seg = { NVP_APROM, image, BENCH_JOB_LEN };
+	struct nvp_session *s;
+	FILE *null;
+	uint16_t devid;
+	int err;
+
+	memset(r, 0, sizeof(*r));
+	r->status = "ok";
+	pgm = &pgm_sim_backend;
+	icp_dev = dev;
+
+	quiet(1);
+
+	if (pgm_init() < 0) {
+		r->status = "no_backend";
+		goto out;
+	}
+
+	/* the target ignores the lines until it is in ICP mode */
+	span_begin();
+	for (int i = 0; i < BENCH_WORDS; i++)
+		icp_bitsend(0xa5c3f0 ^ i, 24);
+	span_end(&r->bits);
+
+	icp_init();
+
+	/* the smallest complete transaction: a command and a one byte read */
+	span_begin();
+	for (int i = 0; i < BENCH_CMDS; i++)
+		icp_read_cid();
+	span_end(&r->cmds);
+
+	span_begin();
+	icp_read_flash(APROM_FLASH_ADDR, dev->flash_size, data);
+	span_end(&r->read);
+
+	make_image(image, dev->flash_size, 0);
+	program_plan(&plan, image, dev->flash_size);
+	icp_mass_erase();
+	span_begin();
+	plan_program(&plan);
+	span_end(&r->dense);
+
+	/* the erased pages in between are skipped */
+	make_image(image, dev->flash_size, 1);
+	program_plan(&plan, image, dev->flash_size);
+	icp_mass_erase();
+	span_begin();
+	plan_program(&plan);
+	span_end(&r->sparse);
+
+	icp_exit();
+	pgm_deinit();
+
+	/* complete runs as nuvoicp -w and -r do them, from entry to exit */
+	make_image(image, dev->flash_size, 0);
+	program_plan(&plan, image, dev->flash_size);
+	span_begin();
+	r->status = run_icp(&plan, 1, NULL, &devid) ? : "no_backend";
+	span_end(&r->full_write);
+
+	if ((null = fopen("/dev/null", "wb"))) {
+		span_begin();
+		if (!strcmp(r->status, "ok"))
+			r->status = run_icp(&plan, 0, null, &devid) ? : "no_backend";
+		span_end(&r->full_read);
+		fclose(null);
+	}
+
+	/* a small job through libnuvoprog, as a programming service would run it */
+	span_begin();
+	if ((s = nvp_open_icp("sim", &err))) {
+		if (nvp_program(s, &seg, 1) < 0 && !strcmp(r->status, "ok"))
+			r->status = nvp_status(s);
+		nvp_close(s);
+	} else if (!strcmp(r->status, "ok"))
+		r->status = "job_failed";
+	span_end(&r->job);
+
+out:
+	quiet(0);
+}
+
+static void print_icp(const char *model, const struct icp_result *r, const struct nuvo_device *dev,
+		      int last)
+{
+	printf("\t\t\"%s\": {\n", model);
+	printf("\t\t\t\"status\": \"%s\",\n", r->status);
+	print_rate("\t\t\t", "bits_per_s", BENCH_WORDS * 24, r->bits.ns);
+	print_rate("\t\t\t", "commands_per_s", BENCH_CMDS, r->cmds.ns);
+	print_rate("\t\t\t", "read_bytes_per_s", dev->flash_size, r->read.ns);
+	print_rate("\t\t\t", "program_dense_bytes_per_s", dev->flash_size, r->dense.ns);
+	print_rate("\t\t\t", "program_sparse_bytes_per_s", dev->flash_size, r->sparse.ns);
+	printf("\t\t\t\"full_write_s\": %.6f,\n", r->full_write.ns / 1e9);
+	printf("\t\t\t\"full_read_s\": %.6f,\n", r->full_read.ns / 1e9);
+	printf("\t\t\t\"job_s\": %.6f\n", r->job.ns / 1e9);
+	printf("\t\t}%s\n", last ? "" : ",");
+}
+
+/*
+ * What the engine itself costs: the wall time of the passes with the
+ * 'ideal' model, where the simulated lines cost nothing
+ */
+static void print_host(const struct nuvo_device *dev)
+{
+	uint64_t bits[runs], cmds[runs], read[runs], write[runs], job[runs];
+	struct icp_result r;
+
+	sim_set_cost_model("ideal");
+
+	for (int i = 0; i < runs; i++) {
+		bench_icp(&r, dev);
+		bits[i] = r.bits.wall_ns;
+		cmds[i] = r.cmds.wall_ns;
+		read[i] = r.read.wall_ns;
+		write[i] = r.full_write.wall_ns;
+		job[i] = r.job.wall_ns;
+	}
+
+	printf("\t\"host\": {\n");
+	printf("\t\t\"runs\": %d,\n", runs);
+	printf("\t\t\"ns_per_bit\": %.2f,\n", median(bits, runs) / (BENCH_WORDS * 24.0));
+	printf("\t\t\"ns_per_command\": %.1f,\n", median(cmds, runs) / (double)BENCH_CMDS);
+	printf("\t\t\"read_bytes_per_s\": %.1f,\n", rate(dev->flash_size, median(read, runs)));
+	printf("\t\t\"full_write_s\": %.6f,\n", median(write, runs) / 1e9);
+	printf("\t\t\"job_s\": %.6f\n", median(job, runs) / 1e9);
+	printf("\t}");
+}
+
+/* ISP, wall time of single passes */
+struct isp_result {
+	const char *status;
+	uint32_t len;
+	struct span connect, dense, crc, unchanged_job;
+	struct isp_stats stats;
+};
+
+/* connect and program, the link stays open */
+static const char *isp_pass(struct isp_link *l, const char *port, const uint8_t *image,
+			    uint32_t len, struct span *connect, struct span *program)
+{
+	static struct flash_plan plan;
+	const struct nuvo_device *dev;
+	const char *status;
+	struct span dummy;
+
+	span_begin();
+	if (isp_open(l, port, 115200) < 0)
+		return "no_port";
+	if (isp_connect(l, 5000) < 0)
+		return "no_response";
+	if (!(dev = device_find(isp_read_device_id(l))))
+		return "unknown_device";
+	span_end(connect ? : &dummy);
+
+	plan_init(&plan);
+	plan_set_aprom(&plan, image, len);
+	plan_layout(&plan, dev);
+
+	span_begin();
+	status = isp_program_plan(l, &plan);
+	span_end(program);
+
+	return status;
+}
+
+static void bench_isp(struct isp_result *r, const char *port)
+{
+	static uint8_t image[FLASH_MAX_SIZE];
+	struct isp_link l = { .fd = -1 };
+	struct span program;
+	uint64_t t;
+	uint32_t crc;
+
+	memset(r, 0, sizeof(*r));
+	isp_only = 1;
+	quiet(1);
+
+	/* fits next to the largest LDROM of whichever part is connected */
+	r->len = FLASH_MAX_SIZE;
+	for (int i = 0; i < num_devices; i++)
+		if (devices[i].flash_size - devices[i].ldrom_max < r->len)
+			r->len = devices[i].flash_size - devices[i].ldrom_max;
+
+	make_image(image, r->len, 0);
+	if (strcmp(r->status = isp_pass(&l, port, image, r->len, &r->connect, &r->dense), "ok"))
+		goto out;
+
+	span_begin();
+	if (!isp_crc32(&l, APROM_FLASH_ADDR, r->len, &crc))
+		span_end(&r->crc);
+	r->stats = l.stats;
+	isp_close(&l);
+
+	/* the same image again: a complete job that finds nothing to do */
+	t = wall_ns();
+	if (!strcmp(r->status = isp_pass(&l, port, image, r->len, NULL, &program), "ok"))
+		isp_run_aprom(&l);
+	isp_close(&l);
+	r->unchanged_job.wall_ns = wall_ns() - t;
+
+out:
+	isp_close(&l);
+	isp_only = 0;
+	quiet(0);
+}
+
+static void print_isp(const struct isp_result *r)
+{
+	printf(",\n\t\"isp\": {\n");
+	printf("\t\t\"status\": \"%s\",\n", r->status);
+	printf("\t\t\"baud\": 115200,\n");
+	printf("\t\t\"image_bytes\": %u,\n", r->len);
+	printf("\t\t\"connect_s\": %.6f,\n", r->connect.wall_ns / 1e9);
+	print_rate("\t\t", "program_dense_bytes_per_s", r->len, r->dense.wall_ns);
+	print_rate("\t\t", "crc_bytes_per_s", r->len, r->crc.wall_ns);
+	printf("\t\t\"unchanged_job_s\": %.6f,\n", r->unchanged_job.wall_ns / 1e9);
+	printf("\t\t\"rtt_avg_ms\": %.3f\n", r->stats.packets ?
+		r->stats.rtt_ns / 1e6 / r->stats.packets : 0);
+	printf("\t}");
+}
+
+/* the emulator on a pty of its own, linked to from a path we choose */
+static pid_t emu_start(const char *script, const char *link)
+{
+	pid_t pid = fork();
+
+	if (pid < 0)
+		return -1;
+
+	if (!pid) {
+		int fd = open("/dev/null", O_RDWR);
+
+		dup2(fd, 1);
+		dup2(fd, 2);
+		execlp("python3", "python3", script, "--nuvoboot", "--link", link, (char *)NULL);
+		_exit(127);
+	}
+
+	for (int i = 0; i < 100; i++) {
+		if (!access(link, F_OK))
+			return pid;
+		if (waitpid(pid, NULL, WNOHANG) == pid)
+			return -1;
+		usleep(50000);
+	}
+
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	return -1;
+}
+
+static void emu_stop(pid_t pid)
+{
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"nuvobench, benchmarks of the nuvoicp programming engines\n\n"
+		"Usage:\n"
+		"\t[-d, --sim-device <part> part number of the simulated target, default N76E003]\n"
+		"\t[-e, --isp-emu <ispemu.py> benchmark ISP against the bootloader emulator]\n"
+		"\t[-i, --isp <tty> benchmark ISP against the bootloader on this port,\n"
+		"\t     its APROM is overwritten]\n"
+		"\t[-n, --runs <n> runs of the wall time measurements, default 5]\n"
+		"\t[-v, --verbose keep the engine's log on stderr]\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	const struct nuvo_device *dev = &devices[0];
+	const char *port = NULL, *emu = NULL;
+	char link[64];
+	struct icp_result r;
+	struct isp_result ir;
+	pid_t emu_pid = -1;
+	int opt, n = sizeof(cost_models) / sizeof(cost_models[0]);
+
+	static const struct option long_opts[] = {
+		{ "sim-device", required_argument, NULL, 'd' },
+		{ "isp-emu", required_argument, NULL, 'e' },
+		{ "isp", required_argument, NULL, 'i' },
+		{ "runs", required_argument, NULL, 'n' },
+		{ "verbose", no_argument, NULL, 'v' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	while ((opt = getopt_long(argc, argv, "d:e:i:n:vh", long_opts, NULL)) != -1) {
+		switch (opt) {
+		case 'd':
+			if (sim_set_device(optarg) < 0)
+				return 1;
+			dev = device_find_name(optarg);
+			break;
+		case 'e':
+			emu = optarg;
+			break;
+		case 'i':
+			port = optarg;
+			break;
+		case 'n':
+			if ((runs = atoi(optarg)) < 1)
+				usage();
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (emu && !port) {
+		snprintf(link, sizeof(link), "/tmp/nuvobench-%d", getpid());
+		if ((emu_pid = emu_start(emu, link)) < 0) {
+			fprintf(stderr, "Could not start %s\n", emu);
+			return 1;
+		}
+		port = link;
+	}
+
+	printf("{\n\t\"version\": %d,\n", BENCH_VERSION);
+	printf("\t\"device\": \"%s\",\n", dev->name);
+	printf("\t\"icp\": {\n");
+
+	for (int i = 0; i < n; i++) {
+		sim_set_cost_model(cost_models[i]);
+		bench_icp(&r, dev);
+		print_icp(cost_models[i], &r, dev, i == n - 1);
+	}
+
+	printf("\t},\n");
+	print_host(dev);
+
+	if (port) {
+		bench_isp(&ir, port);
+		print_isp(&ir);
+	}
+
+	printf("\n}\n");
+
+	if (emu_pid > 0)
+		emu_stop(emu_pid);
+
+	return 0;
+}
@@ -0,0 +1,267 @@
+/*
+ * nuvoicp, a RPi ICP flasher for the Nuvoton N76E003
+ * https://github.com/steve-m/N76E003-playground
+ *
+ * Copyright (c) 2021 Steve Markgraf <steve@steve-m.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Local cache of prepared images, shared with nuvoispy/nuvopkg.py:
+ *
+ *   <dir>/objects/<hash>.nvp	packages, named by the FNV-1a hash of their content
+ *   <dir>/index/<hash>		symlinks to objects, named by the hash of the
+ *				source files' path, size, mtime and inode
+ *
+ * A hit costs a stat() of the sources and a mapping of a file that is
+ * most likely in the page cache already. Entries are written to a
+ * temporary name and renamed, so readers see all of an entry or none.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "nuvoicp.h"
+
+#define PKG_ALIGN(x, a)		(((x) + (a) - 1) / (a) * (a))
+
+uint64_t fnv1a64(const void *buf, size_t len, uint64_t hash)
+{
+	const uint8_t *p = buf;
+
+	while (len--)
+		hash = (hash ^ *p++) * 0x100000001b3ULL;
+
+	return hash;
+}
+
+#define FNV1A64_INIT		0xcbf29ce484222325ULL
+
+/* what identifies a source file without reading it */
+static int cache_key(char *key, size_t size, const char *region, const char *filename)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	size_t len = strlen(key);
+	const char *ext = filename ? strrchr(filename, '.') : NULL;
+
+	if (!filename)
+		return 0;
+
+	/* nuvopkg.py converts Intel HEX, we don't, keep out of each other's way */
+	if (ext && (!strcasecmp(ext, ".ihx") || !strcasecmp(ext, ".hex")))
+		return -EINVAL;
+
+	if (!realpath(filename, path) || stat(path, &st) < 0)
+		return -errno;
+
+	snprintf(key + len, size - len, "%s %s %llu %llu %llu\n", region, path,
+		 (unsigned long long)st.st_size,
+		 (unsigned long long)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec,
+		 (unsigned long long)st.st_ino);
+
+	return 0;
+}
+
+static int read_file(const char *filename, uint8_t *buf, size_t size)
+{
+	FILE *f = fopen(filename, "rb");
+	size_t len;
+
+	if (!f)
+		return -errno;
+
+	len = fread(buf, 1, size, f);
+	fclose(f);
+
+	return len;
+}
+
+/* the same layout as build() in nuvopkg.py */
+static size_t pkg_build(uint8_t *buf, const uint8_t *aprom, uint32_t aprom_len,
+			const uint8_t *ldrom, uint32_t ldrom_len)
+{
+	const uint8_t *data[] = { aprom, ldrom };
+	const uint32_t lens[] = { aprom_len, ldrom_len };
+	struct pkg_header *hdr = (struct pkg_header *)buf;
+	struct pkg_segment *seg = (struct pkg_segment *)(buf + sizeof(*hdr));
+	uint32_t digest = 0;
+	size_t off;
+	int n = 0;
+
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, PKG_MAGIC, sizeof(hdr->magic));
+	hdr->version = PKG_VERSION;
+	hdr->page_size = PAGE_SIZE;
+
+	for (int region = PKG_APROM; region <= PKG_LDROM; region++)
+		n += !!data[region];
+
+	off = sizeof(*hdr) + n * sizeof(*seg);
+
+	for (int region = PKG_APROM; region <= PKG_LDROM; region++) {
+		uint32_t len = lens[region];
+
+		if (!data[region])
+			continue;
+
+		memset(seg, 0, sizeof(*seg));
+		seg->region = region;
+		seg->len = len;
+		seg->crc = crc32(data[region], len);
+		digest = crc32_update(digest, data[region], len);
+
+		memset(buf + off, 0xff, PKG_ALIGN(off, 4) - off);
+		off = seg->hash_offset = PKG_ALIGN(off, 4);
+
+		for (uint32_t i = 0; i < len; i += PAGE_SIZE) {
+			uint8_t page[PAGE_SIZE];
+			uint32_t crc, chunk = len - i < PAGE_SIZE ? len - i : PAGE_SIZE;
+
+			memset(page, 0xff, sizeof(page));
+			memcpy(page, data[region] + i, chunk);
+			crc = crc32(page, PAGE_SIZE);
+			memcpy(buf + off, &crc, sizeof(crc));
+			off += sizeof(crc);
+		}
+
+		/* data at a page boundary, so that it can be used in place */
+		memset(buf + off, 0xff, PKG_ALIGN(off, PAGE_SIZE) - off);
+		off = seg->data_offset = PKG_ALIGN(off, PAGE_SIZE);
+		memcpy(buf + off, data[region], len);
+		off += len;
+		seg++;
+	}
+
+	hdr->num_segments = n;
+	hdr->digest = digest;
+
+	return off;
+}
+
+/* write to a temporary name next to it, then rename */
+static int publish(const char *path, const void *buf, size_t len, const char *link_target)
+{
+	char tmp[PATH_MAX];
+	int fd, ret = 0;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp.%d", path, getpid());
+
+	if (link_target) {
+		unlink(tmp);
+		if (symlink(link_target, tmp) < 0)
+			return -errno;
+	} else {
+		if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0444)) < 0)
+			return -errno;
+
+		if (write(fd, buf, len) != len || fsync(fd) < 0)
+			ret = -EIO;
+		close(fd);
+	}
+
+	if (!ret && rename(tmp, path) < 0)
+		ret = -errno;
+	if (ret)
+		unlink(tmp);
+
+	return ret;
+}
+
+static void mkdirs(const char *dir)
+{
+	char path[PATH_MAX];
+
+	mkdir(dir, 0755);
+	snprintf(path, sizeof(path), "%s/objects", dir);
+	mkdir(path, 0755);
+	snprintf(path, sizeof(path), "%s/index", dir);
+	mkdir(path, 0755);
+}
+
+/*
+ * The package for the APROM image (raw or a package itself) and the LDROM
+ * image, either may be NULL. Prepared and published on a miss.
+ */
+int cache_open(struct pkg *pkg, const char *dir, const char *aprom, const char *ldrom)
+{
+	static uint8_t src[2][FLASH_MAX_SIZE];
+	static uint8_t buf[sizeof(struct pkg_header) + 2 * sizeof(struct pkg_segment) +
+			   2 * (FLASH_MAX_SIZE / PAGE_SIZE * 4 + 2 * PAGE_SIZE) + 2 * FLASH_MAX_SIZE];
+	char key[2 * PATH_MAX + 128] = "", index[PATH_MAX], object[PATH_MAX], target[64];
+	const uint8_t *data = buf;
+	int ret, len[2] = { 0, 0 };
+	size_t size;
+	uint64_t hash;
+
+	if ((ret = cache_key(key, sizeof(key), "aprom", aprom)) < 0 ||
+	    (ret = cache_key(key, sizeof(key), "ldrom", ldrom)) < 0)
+		return ret;
+
+	snprintf(index, sizeof(index), "%s/index/%016llx", dir,
+		 (unsigned long long)fnv1a64(key, strlen(key), FNV1A64_INIT));
+
+	if (!pkg_open(pkg, index))
+		return 0;
+
+	/* a package is cached as it is */
+	if (aprom && !pkg_open(pkg, aprom)) {
+		if (ldrom) {
+			pkg_close(pkg);
+			return -EINVAL;
+		}
+		data = pkg->map;
+		size = pkg->size;
+	} else {
+		if ((aprom && (len[0] = read_file(aprom, src[0], FLASH_MAX_SIZE)) < 0) ||
+		    (ldrom && (len[1] = read_file(ldrom, src[1], LDROM_MAX_SIZE)) < 0))
+			return aprom && len[0] < 0 ? len[0] : len[1];
+
+		size = pkg_build(buf, aprom ? src[0] : NULL, len[0], ldrom ? src[1] : NULL, len[1]);
+	}
+
+	hash = fnv1a64(data, size, FNV1A64_INIT);
+	snprintf(target, sizeof(target), "../objects/%016llx.nvp", (unsigned long long)hash);
+	snprintf(object, sizeof(object), "%s/objects/%016llx.nvp", dir, (unsigned long long)hash);
+
+	mkdirs(dir);
+	ret = access(object, F_OK) ? publish(object, data, size, NULL) : 0;
+	if (!ret)
+		ret = publish(index, NULL, 0, target);
+
+	if (data != buf)
+		pkg_close(pkg);
+	if (ret < 0)
+		return ret;
+
+	fprintf(stderr, "Cached %s%s%s as %s\n", aprom ? aprom : "", aprom && ldrom ? " and " : "",
+		ldrom ? ldrom : "", object);
+
+	return pkg_open(pkg, index);
+}
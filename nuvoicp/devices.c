@@ -0,0 +1,128 @@
+/*
+ * nuvoicp, a RPi ICP flasher for the Nuvoton N76E003
+ * https://github.com/steve-m/N76E003-playground
+ *
+ * Copyright (c) 2021 Steve Markgraf <steve@steve-m.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Nuvoton 8051 parts that share the N76E003 ICP protocol. Parts in
+ * different packages with the same die report the same device ID and
+ * share an entry.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#include "nuvoicp.h"
+
+/* CONFIG1 LDSIZE: 111 no LDROM, 110 1 KB, 101 2 KB, 100 3 KB, 0xx 4 KB */
+static const uint8_t ldsize_4k[8] = { 4, 4, 4, 4, 3, 2, 1, 0 };
+
+const struct nuvo_device devices[] = {
+	{
+		.devid		= N76E003_DEVID,
+		.name		= "N76E003",
+		.flash_size	= 18 * 1024,
+		.page_size	= 128,
+		.ldrom_max	= 4 * 1024,
+		.ldrom_kb	= ldsize_4k,
+		.cfg_len	= 5,
+		.prog_us	= { 200, 50 },
+		.page_erase_us	= { 10000, 1000 },
+		.mass_erase_us	= { 100000, 10000 },
+	},
+	/* the same flash macro, ICP timing and LDSIZE encoding as the N76E003 */
+	{
+		.devid		= 0x4b21,
+		.name		= "MS51FB9AE/MS51XB9AE/MS51XB9BE",
+		.flash_size	= 16 * 1024,
+		.page_size	= 128,
+		.ldrom_max	= 4 * 1024,
+		.ldrom_kb	= ldsize_4k,
+		.cfg_len	= 5,
+		.prog_us	= { 200, 50 },
+		.page_erase_us	= { 10000, 1000 },
+		.mass_erase_us	= { 100000, 10000 },
+	},
+	{
+		.devid		= 0x4c21,
+		.name		= "MS51FC0AE/MS51XC0BE",
+		.flash_size	= 32 * 1024,
+		.page_size	= 128,
+		.ldrom_max	= 4 * 1024,
+		.ldrom_kb	= ldsize_4k,
+		.cfg_len	= 5,
+		.prog_us	= { 200, 50 },
+		.page_erase_us	= { 10000, 1000 },
+		.mass_erase_us	= { 100000, 10000 },
+	},
+};
+
+const int num_devices = sizeof(devices) / sizeof(devices[0]);
+
+const struct nuvo_device *device_find(uint16_t devid)
+{
+	for (int i = 0; i < num_devices; i++) {
+		if (devices[i].devid == devid)
+			return &devices[i];
+	}
+
+	return NULL;
+}
+
+/* any of the part numbers of an entry, case does not matter */
+const struct nuvo_device *device_find_name(const char *name)
+{
+	size_t len = strlen(name);
+
+	for (int i = 0; i < num_devices; i++) {
+		const char *n = devices[i].name;
+
+		while (n) {
+			if (!strncasecmp(n, name, len) && (n[len] == '/' || !n[len]))
+				return &devices[i];
+			if ((n = strchr(n, '/')))
+				n++;
+		}
+	}
+
+	return NULL;
+}
+
+/* the LDROM size CONFIG selects */
+uint32_t device_ldrom_size(const struct nuvo_device *d, const uint8_t *cfg)
+{
+	return d->ldrom_kb[cfg[1] & 0x7] * 1024;
+}
+
+/* the LDSIZE bits for an LDROM of len bytes, rounded up to whole KB */
+uint8_t device_ldrom_cfg(const struct nuvo_device *d, uint32_t len)
+{
+	uint8_t ldsize = 7;
+
+	while (ldsize && d->ldrom_kb[ldsize] * 1024 < len)
+		ldsize--;
+
+	return ldsize;
+}
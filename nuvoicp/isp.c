@@ -0,0 +1,421 @@
+/*
+ * nuvoicp, a RPi ICP flasher for the Nuvoton N76E003
+ * https://github.com/steve-m/N76E003-playground
+ *
+ * Copyright (c) 2021 Steve Markgraf <steve@steve-m.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * ISP over UART, talking to the Nuvoton LDROM bootloader with the same
+ * 64 byte packet format as nuvoispy.py.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <termios.h>
+#include <time.h>
+
+#include "nuvoicp.h"
+
+#define ISP_CONNECT_TIMEOUT	50	/* ms, interval of connect requests */
+#define ISP_REPLY_TIMEOUT	250	/* ms, deadline for a complete reply */
+#define ISP_ERASE_TIMEOUT	2000	/* ms, first APROM packet erases first */
+#define ISP_MAX_RETRIES		5
+#define ISP_PAGE_ERASE_US	5000	/* bootloader page erase, for estimates */
+
+#define ISP_FIRST_DATA_LEN	48
+#define ISP_DATA_LEN		56
+
+
+/* independent of the simulated target's virtual clock */
+static uint64_t mono_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static speed_t isp_speed(int baud)
+{
+	switch (baud) {
+	case 9600:	return B9600;
+	case 19200:	return B19200;
+	case 38400:	return B38400;
+	case 57600:	return B57600;
+	case 115200:	return B115200;
+	case 230400:	return B230400;
+	case 460800:	return B460800;
+	case 500000:	return B500000;
+	case 576000:	return B576000;
+	case 921600:	return B921600;
+	case 1000000:	return B1000000;
+	default:	return 0;
+	}
+}
+
+int isp_open(struct isp_link *l, const char *port, int baud)
+{
+	struct termios tio;
+	speed_t speed = isp_speed(baud);
+
+	if (!speed) {
+		fprintf(stderr, "Unsupported baud rate: %d\n", baud);
+		return -EINVAL;
+	}
+
+	memset(l, 0, sizeof(*l));
+	l->fd = open(port, O_RDWR | O_NOCTTY);
+	if (l->fd < 0) {
+		fprintf(stderr, "Failed to open %s: %s\n", port, strerror(errno));
+		return -errno;
+	}
+
+	if (tcgetattr(l->fd, &tio) < 0) {
+		fprintf(stderr, "%s is not a serial port\n", port);
+		isp_close(l);
+		return -ENOTTY;
+	}
+
+	cfmakeraw(&tio);
+	tio.c_cflag |= CLOCAL | CREAD;
+	tio.c_cflag &= ~(CSTOPB | CRTSCTS);
+	tio.c_cc[VMIN] = 0;
+	tio.c_cc[VTIME] = 0;
+	cfsetispeed(&tio, speed);
+	cfsetospeed(&tio, speed);
+
+	if (tcsetattr(l->fd, TCSANOW, &tio) < 0) {
+		fprintf(stderr, "Failed to configure %s\n", port);
+		isp_close(l);
+		return -EIO;
+	}
+
+	tcflush(l->fd, TCIOFLUSH);
+	l->wire_ms = ISP_PACKSIZE * 10 * 1000 / baud + 1;
+
+	return 0;
+}
+
+void isp_close(struct isp_link *l)
+{
+	if (l->fd >= 0)
+		close(l->fd);
+	l->fd = -1;
+}
+
+uint16_t isp_checksum(const uint8_t *buf, int len)
+{
+	uint16_t sum = 0;
+
+	while (len--)
+		sum += *buf++;
+
+	return sum;
+}
+
+/* read exactly len bytes, or less if the deadline passes */
+static int isp_read(struct isp_link *l, uint8_t *buf, int len, int timeout_ms)
+{
+	uint64_t deadline = mono_ns() + (uint64_t)timeout_ms * 1000000;
+	int got = 0;
+
+	while (got < len) {
+		uint64_t now = mono_ns();
+		struct pollfd pfd = { .fd = l->fd, .events = POLLIN };
+
+		if (now >= deadline)
+			break;
+
+		if (poll(&pfd, 1, (deadline - now + 999999) / 1000000) <= 0)
+			break;
+
+		ssize_t n = read(l->fd, buf + got, len - got);
+		if (n <= 0)
+			break;
+		got += n;
+	}
+
+	return got;
+}
+
+static void isp_cmd_packet(struct isp_link *l, uint8_t *tx, uint8_t cmd)
+{
+	memset(tx, 0, ISP_PACKSIZE);
+	tx[0] = cmd;
+	l->seq++;
+	tx[4] = l->seq & 0xff;
+	tx[5] = l->seq >> 8;
+}
+
+/* send a packet and wait for the reply, retransmitting up to retries times */
+static int isp_send_retries(struct isp_link *l, const uint8_t *tx, uint8_t *rx, int timeout_ms,
+			    int retries)
+{
+	for (int tries = 0; tries <= retries; tries++) {
+		if (tries) {
+			l->stats.retransmits++;
+			tcflush(l->fd, TCIFLUSH);
+		}
+
+		uint64_t start = mono_ns();
+
+		if (write(l->fd, tx, ISP_PACKSIZE) != ISP_PACKSIZE)
+			return -EIO;
+		l->stats.packets++;
+
+		if (isp_read(l, rx, ISP_PACKSIZE, timeout_ms + 2 * l->wire_ms) != ISP_PACKSIZE)
+			continue;
+
+		uint64_t rtt = mono_ns() - start;
+		l->stats.rtt_ns += rtt;
+		if (rtt > l->stats.rtt_max_ns)
+			l->stats.rtt_max_ns = rtt;
+
+		if (isp_checksum(tx, ISP_PACKSIZE) != (rx[0] | (rx[1] << 8))) {
+			fprintf(stderr, "Invalid checksum received!\n");
+			l->stats.checksum_errors++;
+			return -EIO;
+		}
+
+		return 0;
+	}
+
+	if (retries)
+		fprintf(stderr, "\nNo response from MCU after %d retries\n", retries);
+	return -ETIMEDOUT;
+}
+
+int isp_send_cmd(struct isp_link *l, const uint8_t *tx, uint8_t *rx, int timeout_ms)
+{
+	return isp_send_retries(l, tx, rx, timeout_ms, ISP_MAX_RETRIES);
+}
+
+/* timeout_ms 0 waits forever, e.g. for the reset button */
+int isp_connect(struct isp_link *l, int timeout_ms)
+{
+	uint8_t tx[ISP_PACKSIZE], rx[ISP_PACKSIZE];
+	uint64_t deadline = mono_ns() + (uint64_t)timeout_ms * 1000000;
+
+	if (!timeout_ms)
+		fprintf(stderr, "Trying to connect to MCU, please press reset button\n");
+
+	while (1) {
+		if (timeout_ms && mono_ns() >= deadline)
+			return -ETIMEDOUT;
+
+		isp_cmd_packet(l, tx, ISP_CMD_CONNECT);
+		tcflush(l->fd, TCIFLUSH);
+
+		if (write(l->fd, tx, ISP_PACKSIZE) != ISP_PACKSIZE)
+			return -EIO;
+
+		if (isp_read(l, rx, ISP_PACKSIZE, ISP_CONNECT_TIMEOUT + 2 * l->wire_ms) != ISP_PACKSIZE)
+			continue;
+
+		if (isp_checksum(tx, ISP_PACKSIZE) == (rx[0] | (rx[1] << 8)))
+			break;
+	}
+
+	isp_cmd_packet(l, tx, ISP_CMD_SYNC_PACKNO);
+	return isp_send_cmd(l, tx, rx, ISP_REPLY_TIMEOUT);
+}
+
+uint16_t isp_read_device_id(struct isp_link *l)
+{
+	uint8_t tx[ISP_PACKSIZE], rx[ISP_PACKSIZE];
+
+	isp_cmd_packet(l, tx, ISP_CMD_GET_DEVICEID);
+	if (isp_send_cmd(l, tx, rx, ISP_REPLY_TIMEOUT) < 0)
+		return 0;
+
+	return (rx[9] << 8) | rx[8];
+}
+
+uint8_t isp_read_fw_version(struct isp_link *l)
+{
+	uint8_t tx[ISP_PACKSIZE], rx[ISP_PACKSIZE];
+
+	isp_cmd_packet(l, tx, ISP_CMD_GET_FWVER);
+	if (isp_send_cmd(l, tx, rx, ISP_REPLY_TIMEOUT) < 0)
+		return 0;
+
+	return rx[8];
+}
+
+/* capabilities of nuvoboot, -ENOTSUP for the stock bootloader */
+int isp_get_caps(struct isp_link *l, struct isp_caps *caps)
+{
+	uint8_t tx[ISP_PACKSIZE], rx[ISP_PACKSIZE];
+	int ret;
+
+	if (!(isp_read_fw_version(l) & ISP_FW_NUVOBOOT))
+		return -ENOTSUP;
+
+	isp_cmd_packet(l, tx, ISP_CMD_GET_CAPS);
+	if ((ret = isp_send_cmd(l, tx, rx, ISP_REPLY_TIMEOUT)) < 0)
+		return ret;
+
+	caps->version = rx[8];
+	caps->payload = rx[9];
+	caps->window = rx[10];
+	caps->bauds = rx[11];
+	caps->features = rx[12];
+
+	return 0;
+}
+
+/* CRC-32 of an APROM range, computed by the bootloader */
+int isp_crc32(struct isp_link *l, uint32_t addr, uint32_t len, uint32_t *crc)
+{
+	uint8_t tx[ISP_PACKSIZE], rx[ISP_PACKSIZE];
+	int ret;
+
+	isp_cmd_packet(l, tx, ISP_CMD_CRC32);
+	for (int i = 0; i < 4; i++) {
+		tx[8 + i] = addr >> (i * 8);
+		tx[12 + i] = len >> (i * 8);
+	}
+
+	if ((ret = isp_send_cmd(l, tx, rx, ISP_ERASE_TIMEOUT)) < 0)
+		return ret;
+
+	l->stats.crc_checks++;
+	*crc = rx[8] | (rx[9] << 8) | (rx[10] << 16) | ((uint32_t)rx[11] << 24);
+
+	return 0;
+}
+
+/* IEEE 802.3 CRC-32, the same as zlib and nuvoboot */
+/* continues crc over more data, like zlib's crc32() */
+uint32_t crc32_update(uint32_t crc, const uint8_t *buf, uint32_t len)
+{
+	crc = ~crc;
+
+	while (len--) {
+		crc ^= *buf++;
+		for (int i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (crc & 1 ? 0xedb88320 : 0);
+	}
+
+	return ~crc;
+}
+
+uint32_t crc32(const uint8_t *buf, uint32_t len)
+{
+	return crc32_update(0, buf, len);
+}
+
+/* projected time of isp_update_aprom(), from the round trips seen so far */
+uint64_t isp_estimate_ns(struct isp_link *l, uint32_t len)
+{
+	uint32_t packets = 1, pages = (len + PAGE_SIZE - 1) / PAGE_SIZE;
+
+	if (!l->stats.packets)
+		return UINT64_MAX;
+
+	if (len > ISP_FIRST_DATA_LEN)
+		packets += (len - ISP_FIRST_DATA_LEN + ISP_DATA_LEN - 1) / ISP_DATA_LEN;
+
+	return packets * (l->stats.rtt_ns / l->stats.packets) +
+	       (uint64_t)pages * ISP_PAGE_ERASE_US * 1000;
+}
+
+/* the bootloader erases the range itself, each reply echoes the checksum */
+int isp_update_aprom(struct isp_link *l, uint32_t addr, uint32_t len, const uint8_t *data)
+{
+	uint8_t tx[ISP_PACKSIZE], rx[ISP_PACKSIZE];
+	uint32_t pos = 0, progress = 0;
+	int ret;
+
+	memset(tx, 0, sizeof(tx));
+	tx[0] = ISP_CMD_UPDATE_APROM;
+	for (int i = 0; i < 4; i++) {
+		tx[8 + i] = addr >> (i * 8);
+		tx[12 + i] = len >> (i * 8);
+	}
+
+	uint32_t n = len < ISP_FIRST_DATA_LEN ? len : ISP_FIRST_DATA_LEN;
+	memcpy(&tx[16], data, n);
+	pos = n;
+
+	ret = isp_send_cmd(l, tx, rx, ISP_ERASE_TIMEOUT);
+
+	while (!ret && pos < len) {
+		n = len - pos < ISP_DATA_LEN ? len - pos : ISP_DATA_LEN;
+
+		/*
+		 * no address in the packet, a resent one would be programmed at
+		 * the next offset: a late reply ends the update instead
+		 */
+		memset(tx, 0, sizeof(tx));
+		memcpy(&tx[8], &data[pos], n);
+		if ((ret = isp_send_retries(l, tx, rx, ISP_REPLY_TIMEOUT, 0)) < 0)
+			fprintf(stderr, "\n%s at APROM offset %u, update aborted\n",
+				ret == -ETIMEDOUT ? "No response from MCU" : "Bad reply", pos);
+		pos += n;
+
+		/* report some progress */
+		if (pos / 256 != progress) {
+			progress = pos / 256;
+			if (l->progress)
+				l->progress(l->progress_arg, pos, len);
+			else
+				fprintf(stderr, ".");
+		}
+	}
+
+	if (progress && !l->progress)
+		fprintf(stderr, "\n");
+
+	return ret;
+}
+
+/* the CONFIG bytes as the bootloader reads them */
+int isp_read_config(struct isp_link *l, uint8_t *cfg)
+{
+	uint8_t tx[ISP_PACKSIZE], rx[ISP_PACKSIZE];
+	int ret;
+
+	isp_cmd_packet(l, tx, ISP_CMD_READ_CONFIG);
+	if ((ret = isp_send_cmd(l, tx, rx, ISP_REPLY_TIMEOUT)) < 0)
+		return ret;
+
+	memcpy(cfg, &rx[8], CFG_FLASH_LEN);
+
+	return 0;
+}
+
+void isp_run_aprom(struct isp_link *l)
+{
+	uint8_t tx[ISP_PACKSIZE];
+
+	isp_cmd_packet(l, tx, ISP_CMD_RUN_APROM);
+	if (write(l->fd, tx, ISP_PACKSIZE) != ISP_PACKSIZE)
+		fprintf(stderr, "Failed to send run command\n");
+	tcdrain(l->fd);
+}
@@ -0,0 +1,376 @@
+/*
+ * libnuvoprog, the nuvoicp programming engine as a library
+ * https://github.com/steve-m/N76E003-playground
+ *
+ * Copyright (c) 2021 Steve Markgraf <steve@steve-m.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "nuvoicp.h"
+#include "libnuvoprog.h"
+
+struct nvp_session {
+	int icp;
+	int active;
+	struct isp_link isp;
+	uint16_t devid;
+	const struct nuvo_device *dev;
+	const char *status;
+	const char *phase;
+	nvp_progress_cb progress;
+	void *progress_arg;
+	struct flash_plan plan;
+	uint8_t read_data[FLASH_MAX_SIZE];
+	struct run_stats stats;
+};
+
+/* the ICP lines and their counters are process wide */
+static pthread_mutex_t icp_lock = PTHREAD_MUTEX_INITIALIZER;
+static int icp_open;
+
+/* where the engine records once the calling thread has no session */
+static struct run_stats no_session;
+
+/* the engine records into the session's statistics, whichever thread calls */
+static void session_enter(struct nvp_session *s)
+{
+	run_stats = &s->stats;
+	isp_only = !s->icp;
+}
+
+static void session_progress(void *arg, uint32_t done, uint32_t total)
+{
+	struct nvp_session *s = arg;
+
+	s->progress(s->progress_arg, s->phase, done, total);
+}
+
+static int status_err(const char *status)
+{
+	if (!strcmp(status, "ok"))
+		return 0;
+	if (!strcmp(status, "no_response"))
+		return -ETIMEDOUT;
+	if (!strcmp(status, "target_lost") || !strcmp(status, "unknown_device"))
+		return -ENODEV;
+	return -EIO;
+}
+
+struct nvp_session *nvp_open_icp(const char *backend, int *err)
+{
+	const struct pgm_backend *b = backend ? pgm_find(backend) : pgm;
+	struct nvp_session *s;
+	int ret;
+
+	if (!b) {
+		*err = -EINVAL;
+		return NULL;
+	}
+
+	if (!(s = calloc(1, sizeof(*s)))) {
+		*err = -ENOMEM;
+		return NULL;
+	}
+
+	pthread_mutex_lock(&icp_lock);
+	ret = icp_open ? -EBUSY : 0;
+	icp_open = 1;
+	pthread_mutex_unlock(&icp_lock);
+
+	if (ret < 0) {
+		*err = ret;
+		free(s);
+		return NULL;
+	}
+
+	s->icp = 1;
+	s->isp.fd = -1;
+	s->status = "ok";
+	pgm = b;
+	session_enter(s);
+	stats_reset();
+	pgm_counters_reset();
+
+	if ((ret = pgm_init()) < 0) {
+		*err = ret;
+		nvp_close(s);
+		return NULL;
+	}
+
+	icp_init();
+	s->active = 1;
+
+	/* a missed edge on entry is worth one more try */
+	s->devid = icp_read_device_id();
+	if (!device_find(s->devid))
+		s->devid = icp_check_sync();
+
+	if (!(s->dev = device_find(s->devid))) {
+		*err = -ENODEV;
+		nvp_close(s);
+		return NULL;
+	}
+
+	icp_dev = s->dev;
+	return s;
+}
+
+struct nvp_session *nvp_open_isp(const char *port, int baud, int connect_timeout_ms, int *err)
+{
+	struct nvp_session *s = calloc(1, sizeof(*s));
+	int ret;
+
+	if (!s) {
+		*err = -ENOMEM;
+		return NULL;
+	}
+
+	s->status = "ok";
+	session_enter(s);
+	stats_reset();
+
+	if ((ret = isp_open(&s->isp, port, baud)) < 0) {
+		*err = ret;
+		free(s);
+		return NULL;
+	}
+	s->active = 1;
+
+	if (!(ret = isp_connect(&s->isp, connect_timeout_ms)))
+		s->devid = isp_read_device_id(&s->isp);
+
+	if (ret < 0 || !(s->dev = device_find(s->devid))) {
+		*err = ret < 0 ? ret : -ENODEV;
+		nvp_close(s);
+		return NULL;
+	}
+
+	return s;
+}
+
+void nvp_close(struct nvp_session *s)
+{
+	if (!s)
+		return;
+
+	if (run_stats == &s->stats)
+		run_stats = &no_session;
+
+	if (s->icp) {
+		if (s->active) {
+			icp_exit();
+			pgm_deinit();
+		}
+		icp_progress = NULL;
+
+		pthread_mutex_lock(&icp_lock);
+		icp_open = 0;
+		pthread_mutex_unlock(&icp_lock);
+	} else
+		isp_close(&s->isp);
+
+	free(s);
+}
+
+void nvp_set_progress(struct nvp_session *s, nvp_progress_cb cb, void *arg)
+{
+	s->progress = cb;
+	s->progress_arg = arg;
+
+	if (s->icp) {
+		icp_progress = cb ? session_progress : NULL;
+		icp_progress_arg = s;
+	} else {
+		s->isp.progress = cb ? session_progress : NULL;
+		s->isp.progress_arg = s;
+	}
+}
+
+uint16_t nvp_device_id(struct nvp_session *s)
+{
+	return s->devid;
+}
+
+const char *nvp_device_name(struct nvp_session *s)
+{
+	return s->dev->name;
+}
+
+int nvp_read_config(struct nvp_session *s, uint8_t cfg[5])
+{
+	if (!s->active)
+		return -ENOTCONN;
+
+	session_enter(s);
+	if (!s->icp)
+		return isp_read_config(&s->isp, cfg);
+
+	s->phase = "read";
+	icp_read_flash(CFG_FLASH_ADDR, s->dev->cfg_len, cfg);
+
+	return 0;
+}
+
+int nvp_program(struct nvp_session *s, const struct nvp_segment *segs, int nsegs)
+{
+	struct flash_plan *p = &s->plan;
+	const struct nvp_segment *aprom = NULL, *ldrom = NULL, *cfg = NULL;
+
+	if (!s->active)
+		return -ENOTCONN;
+
+	session_enter(s);
+	for (int i = 0; i < nsegs; i++) {
+		if (segs[i].region == NVP_APROM)
+			aprom = &segs[i];
+		else if (segs[i].region == NVP_LDROM && segs[i].len && segs[i].len <= s->dev->ldrom_max)
+			ldrom = &segs[i];
+		else if (segs[i].region == NVP_CONFIG && segs[i].len == s->dev->cfg_len)
+			cfg = &segs[i];
+		else
+			return -EINVAL;
+	}
+
+	/* the bootloader can't replace itself */
+	if (!s->icp && (ldrom || cfg || !aprom))
+		return -ENOTSUP;
+
+	/* the LDROM size decides how much APROM there is */
+	plan_init(p);
+	if (ldrom)
+		plan_set_ldrom(p, ldrom->data, ldrom->len);
+	if (aprom)
+		plan_set_aprom(p, aprom->data, aprom->len);
+	if (cfg)
+		plan_set_config(p, cfg->data, cfg->len);
+
+	/* over ISP it is the LDROM the bootloader runs from */
+	if (!s->icp) {
+		uint8_t chip_cfg[CFG_FLASH_LEN];
+		int ret;
+
+		if ((ret = isp_read_config(&s->isp, chip_cfg)) < 0)
+			return ret;
+		plan_set_config(p, chip_cfg, s->dev->cfg_len);
+	}
+
+	if (plan_layout(p, s->dev) < p->aprom_in_len || (aprom && aprom->len > FLASH_MAX_SIZE))
+		return -EFBIG;
+
+	if (!s->icp) {
+		s->phase = "program";
+		s->status = isp_program_plan(&s->isp, p);
+		return status_err(s->status);
+	}
+
+	s->phase = "erase";
+	if (s->progress)
+		s->progress(s->progress_arg, s->phase, 0, 1);
+
+	stats_begin();
+	icp_mass_erase();
+	stats_end(PHASE_ERASE, 0);
+
+	if (s->progress)
+		s->progress(s->progress_arg, s->phase, 1, 1);
+
+	s->phase = "program";
+	stats_begin();
+	uint32_t programmed = plan_program(p);
+	stats_end(PHASE_PROGRAM, programmed);
+
+	s->phase = "verify";
+	s->status = icp_verify(p, s->read_data);
+
+	return status_err(s->status);
+}
+
+int nvp_read_flash(struct nvp_session *s, uint32_t addr, uint32_t len, uint8_t *data)
+{
+	if (!s->icp)
+		return -ENOTSUP;
+	if (!s->active)
+		return -ENOTCONN;
+
+	/* flash or CONFIG, written so that addr + len can't wrap */
+	if ((len > s->dev->flash_size || addr > s->dev->flash_size - len) &&
+	    (addr < CFG_FLASH_ADDR || len > s->dev->cfg_len ||
+	     addr - CFG_FLASH_ADDR > s->dev->cfg_len - len))
+		return -EINVAL;
+
+	session_enter(s);
+	s->phase = "read";
+	icp_read_flash(addr, len, data);
+
+	return 0;
+}
+
+int nvp_run(struct nvp_session *s)
+{
+	if (!s->active)
+		return -ENOTCONN;
+
+	session_enter(s);
+
+	/* leaving ICP mode releases reset */
+	if (s->icp) {
+		icp_exit();
+		pgm_deinit();
+	} else
+		isp_run_aprom(&s->isp);
+
+	s->active = 0;
+
+	return 0;
+}
+
+const char *nvp_status(struct nvp_session *s)
+{
+	return s->status;
+}
+
+char *nvp_stats_json(struct nvp_session *s)
+{
+	char *buf = NULL;
+	size_t len;
+	FILE *f = open_memstream(&buf, &len);
+
+	if (!f)
+		return NULL;
+
+	session_enter(s);
+	stats_print_json(f, s->status, s->devid, &s->isp.stats);
+	fclose(f);
+
+	return buf;
+}
+
+void nvp_free(void *p)
+{
+	free(p);
+}
@@ -0,0 +1,100 @@
+/*
+ * libnuvoprog, the nuvoicp programming engine as a library
+ * https://github.com/steve-m/N76E003-playground
+ *
+ * Copyright (c) 2021 Steve Markgraf <steve@steve-m.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef LIBNUVOPROG_H
+#define LIBNUVOPROG_H
+
+#include <stdint.h>
+
+/*
+ * A session is one connection to one target, either through the ICP
+ * lines or through the UART ISP bootloader. ISP sessions are independent
+ * of each other and can run in parallel threads; there is only one set
+ * of ICP lines, so only one ICP session can be open at a time. A session
+ * may move between threads, but only one thread may use it at a time.
+ * The GPIO counters, delay statistics and trace are those of the ICP
+ * session, ISP sessions report none.
+ *
+ * Functions return 0 or a negative errno value. The engine still logs
+ * what it does to stderr, like nuvoicp.
+ */
+struct nvp_session;
+
+enum nvp_region {
+	NVP_APROM,
+	NVP_LDROM,
+	NVP_CONFIG,
+};
+
+/* one image to program, see nvp_program() */
+struct nvp_segment {
+	enum nvp_region region;
+	const uint8_t *data;
+	uint32_t len;
+};
+
+/* phase is "erase", "program", "verify" or "read" */
+typedef void (*nvp_progress_cb)(void *arg, const char *phase, uint32_t done, uint32_t total);
+
+/* backend "gpiod" or "sim", NULL for the default */
+struct nvp_session *nvp_open_icp(const char *backend, int *err);
+
+/* connect_timeout_ms 0 waits for the reset button forever */
+struct nvp_session *nvp_open_isp(const char *port, int baud, int connect_timeout_ms, int *err);
+
+void nvp_close(struct nvp_session *s);
+
+void nvp_set_progress(struct nvp_session *s, nvp_progress_cb cb, void *arg);
+
+uint16_t nvp_device_id(struct nvp_session *s);
+
+/* part numbers of the device, e.g. "N76E003" */
+const char *nvp_device_name(struct nvp_session *s);
+
+int nvp_read_config(struct nvp_session *s, uint8_t cfg[5]);
+
+/*
+ * Program the segments and verify them. Over ICP the chip is mass erased
+ * first, an LDROM segment also enables LDROM and boot from LDROM, and a
+ * CONFIG segment overrides that. The stock bootloader only updates APROM.
+ */
+int nvp_program(struct nvp_session *s, const struct nvp_segment *segs, int nsegs);
+
+/* flash or CONFIG content, ICP only */
+int nvp_read_flash(struct nvp_session *s, uint32_t addr, uint32_t len, uint8_t *data);
+
+/* leave the bootloader or ICP mode and start APROM, ends the session */
+int nvp_run(struct nvp_session *s);
+
+/* status of the last operation, as in the JSON statistics */
+const char *nvp_status(struct nvp_session *s);
+
+/* the JSON statistics of nuvoicp -s for this session, free with nvp_free() */
+char *nvp_stats_json(struct nvp_session *s);
+
+void nvp_free(void *p);
+
+#endif
@@ -28,103 +28,394 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <unistd.h>
-#include <gpiod.h>
 #include <string.h>
 #include <errno.h>
+#include <getopt.h>
+#include <time.h>
 
-/* GPIO line numbers for RPi, must be changed for other SBCs */
-#define GPIO_DAT	20
-#define GPIO_RST	21
-#define GPIO_CLK	26
+#include "nuvoicp.h"
 
-#define N76E003_DEVID	0x3650
+#ifdef NO_GPIOD
+const struct pgm_backend *pgm = &pgm_sim_backend;
+#else
+const struct pgm_backend *pgm = &pgm_gpiod_backend;
+#endif
 
-#define FLASH_SIZE	(18 * 1024)
-#define LDROM_MAX_SIZE	(4 * 1024)
+static const struct pgm_backend *backends[] = {
+#ifndef NO_GPIOD
+	&pgm_gpiod_backend,
+#endif
+	&pgm_sim_backend,
+};
 
-#define APROM_FLASH_ADDR	0x0
-#define CFG_FLASH_ADDR		0x30000
-#define CFG_FLASH_LEN		5
+const struct pgm_backend *pgm_find(const char *name)
+{
+	for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+		if (!strcmp(name, backends[i]->name))
+			return backends[i];
+	}
 
-#define CMD_READ_UID		0x04
-#define CMD_READ_CID		0x0b
-#define CMD_READ_DEVICE_ID	0x0c
-#define CMD_READ_FLASH		0x00
-#define CMD_WRITE_FLASH		0x21
-#define CMD_MASS_ERASE		0x26
-#define CMD_PAGE_ERASE		0x22
+	return NULL;
+}
 
-#define CONSUMER "nuvoicp"
-struct gpiod_chip *chip;
-struct gpiod_line *dat_line, *rst_line, *clk_line;
+void (*icp_progress)(void *arg, uint32_t done, uint32_t total);
+void *icp_progress_arg;
 
-int pgm_init(void)
+const struct nuvo_device *icp_dev = &devices[0];
+
+/*
+ * no GPIOs involved in what this thread runs, time is always wall time;
+ * libnuvoprog sets it from the session on every call
+ */
+__thread int isp_only;
+
+/*
+ * the UART phases of a hybrid run take wall time, even when the backend
+ * has a virtual clock: they move the run's time on by what they took
+ */
+static __thread uint64_t uart_ns, uart_start;
+
+static uint64_t wall_ns(void)
 {
-	int ret;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t time_ns(void)
+{
+	if (pgm && pgm->clock_ns && !isp_only)
+		return pgm->clock_ns() + uart_ns + (uart_start ? wall_ns() - uart_start : 0);
+
+	return wall_ns();
+}
+
+static void uart_time_begin(void)
+{
+	uart_start = wall_ns();
+}
+
+static void uart_time_end(void)
+{
+	uart_ns += wall_ns() - uart_start;
+	uart_start = 0;
+}
+
+/* GPIO operation counters */
+static const char *pgm_op_names[PGM_NUM_OPS] = {
+	[PGM_SET_DAT]	= "set_dat",
+	[PGM_GET_DAT]	= "get_dat",
+	[PGM_SET_RST]	= "set_rst",
+	[PGM_SET_CLK]	= "set_clk",
+	[PGM_DAT_DIR]	= "dat_dir",
+};
+
+struct pgm_counters pgm_cnt;
+int pgm_timing;		/* per-call latency measurement, enabled by -c */
+int clk_state;
+
+int log2_bucket(uint64_t val, int shift, int nbuckets)
+{
+	int b = 0;
 
-	chip = gpiod_chip_open_by_name("gpiochip0");
-	if (!chip) {
-		fprintf(stderr, "Open chip failed\n");
-		return -ENOENT;
+	val >>= shift;
+	while (val && b < nbuckets - 1) {
+		val >>= 1;
+		b++;
 	}
 
-	dat_line = gpiod_chip_get_line(chip, GPIO_DAT);
-	rst_line = gpiod_chip_get_line(chip, GPIO_RST);
-	clk_line = gpiod_chip_get_line(chip, GPIO_CLK);
-	if (!dat_line || !clk_line || !rst_line) {
-		fprintf(stderr, "Error getting required GPIO lines!\n");
-		return -ENOENT;
+	return b;
+}
+
+static inline uint64_t pgm_op_begin(void)
+{
+	return pgm_timing ? time_ns() : 0;
+}
+
+static inline void pgm_op_end(enum pgm_op op, uint64_t start)
+{
+	pgm_cnt.calls[op]++;
+
+	if (pgm_timing)
+		pgm_cnt.latency[op][log2_bucket(time_ns() - start, LAT_SHIFT, LAT_BUCKETS)]++;
+}
+
+/* requested vs. actual sleep time, one slot per distinct requested delay */
+#define DELAY_SLOTS		16
+#define OVERSHOOT_BUCKETS	12	/* log2 buckets from <1 us up to >=1 ms */
+
+struct delay_stats {
+	uint32_t requested_us;
+	uint32_t count;
+	uint64_t actual_ns;
+	uint64_t max_ns;
+	uint32_t overshoot[OVERSHOOT_BUCKETS];
+};
+
+struct delay_stats delay_stats[DELAY_SLOTS];
+
+void delay_record(uint32_t us, uint64_t actual_ns)
+{
+	struct delay_stats *d = NULL;
+
+	for (int i = 0; i < DELAY_SLOTS; i++) {
+		if (!delay_stats[i].count || delay_stats[i].requested_us == us) {
+			d = &delay_stats[i];
+			break;
+		}
 	}
 
-	ret = gpiod_line_request_input(dat_line, CONSUMER);
-	ret |= gpiod_line_request_output(rst_line, CONSUMER, 0);
-	ret |= gpiod_line_request_output(clk_line, CONSUMER, 0);
-	if (ret < 0) {
-		fprintf(stderr, "Request line as output failed\n");
-		return -ENOENT;
+	if (!d)
+		return;
+
+	uint64_t req_ns = (uint64_t)us * 1000;
+	uint64_t over_us = actual_ns > req_ns ? (actual_ns - req_ns) / 1000 : 0;
+
+	d->requested_us = us;
+	d->count++;
+	d->actual_ns += actual_ns;
+	if (actual_ns > d->max_ns)
+		d->max_ns = actual_ns;
+	d->overshoot[log2_bucket(over_us, 0, OVERSHOOT_BUCKETS)]++;
+}
+
+void icp_delay(uint32_t us)
+{
+	uint64_t start = time_ns();
+
+	pgm->delay(us);
+	delay_record(us, time_ns() - start);
+}
+
+void pgm_counters_reset(void)
+{
+	memset(&pgm_cnt, 0, sizeof(pgm_cnt));
+	memset(delay_stats, 0, sizeof(delay_stats));
+}
+
+void pgm_counters_print(FILE *f)
+{
+	fprintf(f, "\nGPIO operations:\n");
+	fprintf(f, "ioctls\t\t\t%u\n", pgm_cnt.ioctls);
+	fprintf(f, "direction switches\t%u\n", pgm_cnt.dir_switches);
+	fprintf(f, "clock edges\t\t%u\n", pgm_cnt.clk_edges);
+
+	for (int op = 0; op < PGM_NUM_OPS; op++) {
+		fprintf(f, "%s\t\t\t%u calls", pgm_op_names[op], pgm_cnt.calls[op]);
+
+		for (int b = 0; b < LAT_BUCKETS; b++) {
+			if (pgm_cnt.latency[op][b])
+				fprintf(f, "  %s%uns:%u", b < LAT_BUCKETS - 1 ? "<" : ">=",
+					(1 << (b + LAT_SHIFT)) >> (b == LAT_BUCKETS - 1),
+					pgm_cnt.latency[op][b]);
+		}
+		fprintf(f, "\n");
+	}
+
+	fprintf(f, "\nDelays (requested vs. actual):\n");
+	for (int i = 0; i < DELAY_SLOTS && delay_stats[i].count; i++) {
+		struct delay_stats *d = &delay_stats[i];
+
+		fprintf(f, "%6u us\t%6u calls  avg %.1f us  max %.1f us  overshoot",
+			d->requested_us, d->count, d->actual_ns / 1e3 / d->count,
+			d->max_ns / 1e3);
+
+		for (int b = 0; b < OVERSHOOT_BUCKETS; b++) {
+			if (d->overshoot[b])
+				fprintf(f, "  %s%uus:%u", b < OVERSHOOT_BUCKETS - 1 ? "<" : ">=",
+					(1 << b) >> (b == OVERSHOOT_BUCKETS - 1),
+					d->overshoot[b]);
+		}
+		fprintf(f, "\n");
 	}
+}
+
+void pgm_counters_print_json(FILE *f)
+{
+	fprintf(f, "\t\"gpio\": {\n");
+	fprintf(f, "\t\t\"ioctls\": %u,\n", pgm_cnt.ioctls);
+	fprintf(f, "\t\t\"dir_switches\": %u,\n", pgm_cnt.dir_switches);
+	fprintf(f, "\t\t\"clk_edges\": %u,\n", pgm_cnt.clk_edges);
+	fprintf(f, "\t\t\"ops\": {\n");
+
+	for (int op = 0; op < PGM_NUM_OPS; op++) {
+		fprintf(f, "\t\t\t\"%s\": { \"calls\": %u, \"latency_log2_ns\": [",
+			pgm_op_names[op], pgm_cnt.calls[op]);
+		for (int b = 0; b < LAT_BUCKETS; b++)
+			fprintf(f, "%s%u", b ? ", " : "", pgm_cnt.latency[op][b]);
+		fprintf(f, "] }%s\n", op < PGM_NUM_OPS - 1 ? "," : "");
+	}
+
+	fprintf(f, "\t\t}\n\t},\n");
+	fprintf(f, "\t\"delays\": [\n");
+
+	for (int i = 0; i < DELAY_SLOTS && delay_stats[i].count; i++) {
+		struct delay_stats *d = &delay_stats[i];
+
+		fprintf(f, "\t\t{ \"requested_us\": %u, \"count\": %u, "
+			"\"actual_avg_us\": %.1f, \"actual_max_us\": %.1f, "
+			"\"overshoot_log2_us\": [", d->requested_us, d->count,
+			d->actual_ns / 1e3 / d->count, d->max_ns / 1e3);
+		for (int b = 0; b < OVERSHOOT_BUCKETS; b++)
+			fprintf(f, "%s%u", b ? ", " : "", d->overshoot[b]);
+		fprintf(f, "] }%s\n", i < DELAY_SLOTS - 1 &&
+			delay_stats[i + 1].count ? "," : "");
+	}
+
+	fprintf(f, "\t],\n");
+}
+
+static const char *trace_sig_names[TRACE_NUM_SIGS] = {
+	[TRACE_CLK]	= "clk",
+	[TRACE_DAT]	= "dat",
+	[TRACE_RST]	= "rst",
+	[TRACE_DAT_OE]	= "dat_oe",
+	[TRACE_DAT_IN]	= "dat_in",
+	[TRACE_TGT_DAT]	= "tgt_dat",
+};
+
+struct trace_event {
+	uint64_t ns;
+	uint8_t sig;
+	char val;
+};
+
+int trace_enabled;
+struct trace_event *trace_buf;
+size_t trace_len, trace_size;
+uint64_t trace_start;
+
+void trace_record(enum trace_sig sig, char val)
+{
+	if (trace_len == trace_size) {
+		size_t size = trace_size ? trace_size * 2 : 65536;
+		struct trace_event *buf = realloc(trace_buf, size * sizeof(*buf));
+
+		if (!buf) {
+			fprintf(stderr, "Out of memory, disabling trace\n");
+			trace_enabled = 0;
+			return;
+		}
+
+		trace_buf = buf;
+		trace_size = size;
+	}
+
+	trace_buf[trace_len].ns = time_ns() - trace_start;
+	trace_buf[trace_len].sig = sig;
+	trace_buf[trace_len].val = val;
+	trace_len++;
+}
+
+int trace_write_vcd(const char *filename)
+{
+	FILE *f = fopen(filename, "w");
+
+	if (!f) {
+		fprintf(stderr, "Failed to open trace file %s\n", filename);
+		return -1;
+	}
+
+	fprintf(f, "$version nuvoicp $end\n$timescale 1ns $end\n");
+	fprintf(f, "$scope module icp $end\n");
+	for (int i = 0; i < TRACE_NUM_SIGS; i++)
+		fprintf(f, "$var wire 1 %c %s $end\n", '!' + i, trace_sig_names[i]);
+	fprintf(f, "$upscope $end\n$enddefinitions $end\n");
+
+	fprintf(f, "#0\n$dumpvars\n");
+	for (int i = 0; i < TRACE_NUM_SIGS; i++)
+		fprintf(f, "x%c\n", '!' + i);
+	fprintf(f, "$end\n");
+
+	uint64_t last = 0;
+	for (size_t i = 0; i < trace_len; i++) {
+		if (trace_buf[i].ns != last) {
+			last = trace_buf[i].ns;
+			fprintf(f, "#%llu\n", (unsigned long long)last);
+		}
+		fprintf(f, "%c%c\n", trace_buf[i].val, '!' + trace_buf[i].sig);
+	}
+
+	fclose(f);
+	free(trace_buf);
+	trace_buf = NULL;
+	trace_len = trace_size = 0;
+
+	return 0;
+}
+
+int pgm_init(void)
+{
+	int ret = pgm->init();
+
+	if (ret < 0)
+		return ret;
+
+	trace_start = time_ns();
+	trace(TRACE_DAT_OE, 0);
+	trace(TRACE_DAT, TRACE_Z);
+	trace(TRACE_RST, 0);
+	trace(TRACE_CLK, 0);
 
 	return 0;
 }
 
 void pgm_set_dat(int val)
 {
-	if (gpiod_line_set_value(dat_line, val) < 0)
-		fprintf(stderr, "Setting data line failed\n");
+	uint64_t start = pgm_op_begin();
+
+	pgm->set_dat(val);
+
+	trace(TRACE_DAT, val);
+	pgm_op_end(PGM_SET_DAT, start);
 }
 
 int pgm_get_dat(void)
 {
-	int ret = gpiod_line_get_value(dat_line);
-	if (ret < 0)
-		fprintf(stderr, "Getting data line failed\n");
+	uint64_t start = pgm_op_begin();
+
+	int ret = pgm->get_dat();
+
+	trace(TRACE_DAT_IN, ret);
+	pgm_op_end(PGM_GET_DAT, start);
 	return ret;
 }
 
 void pgm_set_rst(int val)
 {
-	if (gpiod_line_set_value(rst_line, val) < 0)
-		fprintf(stderr, "Setting reset line failed\n");
+	uint64_t start = pgm_op_begin();
+
+	pgm->set_rst(val);
+
+	trace(TRACE_RST, val);
+	pgm_op_end(PGM_SET_RST, start);
 }
 
 void pgm_set_clk(int val)
 {
-	if (gpiod_line_set_value(clk_line, val) < 0)
-		fprintf(stderr, "Setting clock line failed\n");
+	uint64_t start = pgm_op_begin();
+
+	pgm->set_clk(val);
+
+	trace(TRACE_CLK, val);
+	if (val != clk_state)
+		pgm_cnt.clk_edges++;
+	clk_state = val;
+
+	pgm_op_end(PGM_SET_CLK, start);
 }
 
 void pgm_dat_dir(int state)
 {
-	gpiod_line_release(dat_line);
+	uint64_t start = pgm_op_begin();
 
-	int ret;
-	if (state)
-		ret = gpiod_line_request_output(dat_line, CONSUMER, 0);
-	else
-		ret = gpiod_line_request_input(dat_line, CONSUMER);
+	pgm->dat_dir(state);
 
-	if (ret < 0)
-		fprintf(stderr, "Setting data directions failed\n");
+	trace(TRACE_DAT_OE, state);
+	trace(TRACE_DAT, state ? 0 : TRACE_Z);
+	pgm_cnt.dir_switches++;
+	pgm_op_end(PGM_DAT_DIR, start);
 }
 
 void pgm_deinit(void)
@@ -132,7 +423,7 @@ void pgm_deinit(void)
 	/* release reset */
 	pgm_set_rst(1);
 
-	gpiod_chip_close(chip);
+	pgm->deinit();
 }
 
 void icp_bitsend(uint32_t data, int len)
@@ -160,10 +451,10 @@ void icp_init(void)
 
 	while (i--) {
 		pgm_set_rst((icp_seq >> i) & 1);
-		usleep(10000);
+		icp_delay(10000);
 	}
 
-	usleep(100);
+	icp_delay(100);
 
 	icp_bitsend(0x5aa503, 24);
 }
@@ -171,11 +462,11 @@ void icp_init(void)
 void icp_exit(void)
 {
 	pgm_set_rst(1);
-	usleep(5000);
+	icp_delay(5000);
 	pgm_set_rst(0);
-	usleep(10000);
+	icp_delay(10000);
 	icp_bitsend(0xf78f0, 24);
-	usleep(500);
+	icp_delay(500);
 	pgm_set_rst(1);
 }
 
@@ -206,9 +497,9 @@ void icp_write_byte(uint8_t data, int end, int delay1, int delay2)
 {
 	icp_bitsend(data, 8);
 	pgm_set_dat(end);
-	usleep(delay1);
+	icp_delay(delay1);
 	pgm_set_clk(1);
-	usleep(delay2);
+	icp_delay(delay2);
 	pgm_set_dat(0);
 	pgm_set_clk(0);
 }
@@ -258,9 +549,13 @@ uint32_t icp_read_flash(uint32_t addr, uint32_t len, uint8_t *data)
 {
 	icp_send_command(CMD_READ_FLASH, addr);
 
-	for (int i = 0; i < len; i++)
+	for (int i = 0; i < len; i++) {
 		data[i] = icp_read_byte(i == (len-1));
 
+		if (icp_progress && ((i + 1) % 256 == 0 || i == len - 1))
+			icp_progress(icp_progress_arg, i + 1, len);
+	}
+
 	return addr + len;
 }
 
@@ -270,10 +565,12 @@ uint32_t icp_write_flash(uint32_t addr, uint32_t len, uint8_t *data)
 	icp_send_command(CMD_WRITE_FLASH, addr);
 
 	for (int i = 0; i < len; i++) {
-		icp_write_byte(data[i], i == (len-1), 200, 50);
+		icp_write_byte(data[i], i == (len-1), icp_dev->prog_us[0], icp_dev->prog_us[1]);
 
-		/* print some progress */
-		if (((i % 256) == 0) && len > CFG_FLASH_LEN) {
+		/* report some progress */
+		if (icp_progress && ((i + 1) % 256 == 0 || i == len - 1))
+			icp_progress(icp_progress_arg, i + 1, len);
+		else if (!icp_progress && ((i % 256) == 0) && len > CFG_FLASH_LEN) {
 			fprintf(stderr, ".");
 			progress_printed++;
 		}
@@ -285,30 +582,798 @@ uint32_t icp_write_flash(uint32_t addr, uint32_t len, uint8_t *data)
 	return addr + len;
 }
 
-void icp_dump_config()
+void icp_dump_config(const struct nuvo_device *dev)
 {
 	uint8_t cfg[CFG_FLASH_LEN];
-	icp_read_flash(CFG_FLASH_ADDR, CFG_FLASH_LEN, cfg);
+	icp_read_flash(CFG_FLASH_ADDR, dev->cfg_len, cfg);
 
 	fprintf(stderr, "MCU Boot select:\t%s\n", cfg[0] & 0x80 ? "APROM" : "LDROM");
 
-	int ldrom_size = (7 - (cfg[1] & 0x7)) * 1024;
+	uint32_t ldrom_size = device_ldrom_size(dev, cfg);
 	fprintf(stderr, "LDROM size:\t\t%d Bytes\n", ldrom_size);
-	fprintf(stderr, "APROM size:\t\t%d Bytes\n", FLASH_SIZE - ldrom_size);
+	fprintf(stderr, "APROM size:\t\t%d Bytes\n", dev->flash_size - ldrom_size);
+
+	static const char *bov[] = { "4.4", "3.7", "2.7", "2.2" };
+	int wdt = cfg[4] >> 4;
+	fprintf(stderr, "Security lock:\t\t%s\n", cfg[0] & 0x02 ? "unlocked" : "locked");
+	fprintf(stderr, "P2.0/RST pin:\t\t%s\n", cfg[0] & 0x04 ? "reset" : "input");
+	fprintf(stderr, "OCD:\t\t\t%s\n", cfg[0] & 0x10 ? "disabled" : "enabled");
+	fprintf(stderr, "Brown-out detect:\t%s, %s V, %s\n", cfg[2] & 0x80 ? "enabled" : "disabled",
+		bov[(cfg[2] >> 4) & 0x3], cfg[2] & 0x04 ? "reset" : "interrupt only");
+	fprintf(stderr, "Watchdog:\t\t%s\n", wdt == 0xf ? "disabled" :
+		wdt == 0x5 ? "enabled, stops in idle and power-down" :
+		"enabled, runs in idle and power-down");
 }
 
 void icp_mass_erase(void)
 {
 	icp_send_command(CMD_MASS_ERASE, 0x3A5A5);
-	icp_write_byte(0xff, 1, 100000, 10000);
+	icp_write_byte(0xff, 1, icp_dev->mass_erase_us[0], icp_dev->mass_erase_us[1]);
 }
 
 void icp_page_erase(uint32_t addr)
 {
 	icp_send_command(CMD_PAGE_ERASE, addr);
-	icp_write_byte(0xff, 1, 10000, 1000);
+	icp_write_byte(0xff, 1, icp_dev->page_erase_us[0], icp_dev->page_erase_us[1]);
+}
+
+/* a page, or what of it lies before end, left at 0xff */
+static int page_blank(struct flash_plan *p, uint32_t addr, uint32_t end)
+{
+	uint32_t len = p->dev->page_size < end - addr ? p->dev->page_size : end - addr;
+
+	while (len--)
+		if (p->image[addr++] != 0xff)
+			return 0;
+
+	return 1;
+}
+
+/* the pages of a range that hold data, erased ones are skipped; returns the bytes written */
+static uint32_t plan_write_used(struct flash_plan *p, uint32_t addr, uint32_t len)
+{
+	uint32_t end = addr + len, start, bytes = 0;
+
+	while (addr < end) {
+		while (addr < end && page_blank(p, addr, end))
+			addr += p->dev->page_size;
+
+		for (start = addr; addr < end && !page_blank(p, addr, end); )
+			addr += p->dev->page_size;
+
+		if (addr > end)
+			addr = end;
+		if (addr > start) {
+			icp_write_flash(start, addr - start, &p->image[start]);
+			bytes += addr - start;
+		}
+	}
+
+	return bytes;
+}
+
+/* program CONFIG, LDROM and APROM of an erased chip */
+uint32_t plan_program(struct flash_plan *p)
+{
+	uint32_t bytes = 0;
+
+	if (p->write_cfg) {
+		icp_write_flash(CFG_FLASH_ADDR, p->dev->cfg_len, p->cfg);
+		bytes += p->dev->cfg_len;
+	}
+
+	if (p->ldrom_len) {
+		bytes += plan_write_used(p, p->ldrom_addr, p->ldrom_len);
+		fprintf(stderr, "Programmed LDROM (%d bytes)\n", p->ldrom_len);
+	}
+
+	if (p->aprom_len) {
+		bytes += plan_write_used(p, APROM_FLASH_ADDR, p->aprom_len);
+		fprintf(stderr, "Programmed APROM (%d bytes)\n", p->aprom_len);
+	}
+
+	return bytes;
+}
+
+/* mark pages that differ from the plan, returns the number of bad pages */
+int plan_compare(struct flash_plan *p, uint8_t *data, uint8_t *bad_pages)
+{
+	uint32_t page_size = p->dev->page_size;
+	int bad = 0;
+
+	for (int page = 0; page < p->dev->flash_size / page_size; page++) {
+		uint32_t addr = page * page_size;
+
+		bad_pages[page] = !!memcmp(&p->image[addr], &data[addr], page_size);
+		bad += bad_pages[page];
+	}
+
+	return bad;
+}
+
+void plan_init(struct flash_plan *p)
+{
+	memset(p, 0, sizeof(*p));
+	memset(p->image, 0xff, sizeof(p->image));
+}
+
+void plan_set_ldrom(struct flash_plan *p, const uint8_t *data, uint32_t len)
+{
+	p->ldrom_in_len = len < LDROM_MAX_SIZE ? len : LDROM_MAX_SIZE;
+	memcpy(p->ldrom, data, p->ldrom_in_len);
+}
+
+void plan_set_aprom(struct flash_plan *p, const uint8_t *data, uint32_t len)
+{
+	p->aprom_in_len = len < FLASH_MAX_SIZE ? len : FLASH_MAX_SIZE;
+	p->aprom_crc_valid = 0;
+	memcpy(p->aprom, data, p->aprom_in_len);
+}
+
+/* CONFIG as given, instead of the one derived from the LDROM */
+void plan_set_config(struct flash_plan *p, const uint8_t *data, uint32_t len)
+{
+	p->cfg_in_len = len < CFG_FLASH_LEN ? len : CFG_FLASH_LEN;
+	memcpy(p->cfg_in, data, p->cfg_in_len);
+}
+
+/*
+ * Place the images in the flash of dev: LDROM at the end, sized in whole
+ * KB and booted from, APROM up to it. Returns the APROM length that fits.
+ */
+uint32_t plan_layout(struct flash_plan *p, const struct nuvo_device *dev)
+{
+	uint32_t aprom_size = dev->flash_size;
+
+	p->dev = dev;
+	p->write_cfg = 0;
+	p->ldrom_addr = dev->flash_size;
+	p->ldrom_len = 0;
+	memset(p->image, 0xff, sizeof(p->image));
+
+	if (p->ldrom_in_len) {
+		uint32_t len = p->ldrom_in_len < dev->ldrom_max ? p->ldrom_in_len : dev->ldrom_max;
+		uint8_t ldrom_sz_cfg = device_ldrom_cfg(dev, len);
+
+		/* configure LDROM size and enable boot from LDROM */
+		uint8_t cfg[CFG_FLASH_LEN] = { 0x7f, 0xf8 | ldrom_sz_cfg, 0xff, 0xff, 0xff };
+		memcpy(p->cfg, cfg, CFG_FLASH_LEN);
+		p->write_cfg = 1;
+
+		p->ldrom_addr = dev->flash_size - device_ldrom_size(dev, cfg);
+		p->ldrom_len = len;
+		memcpy(&p->image[p->ldrom_addr], p->ldrom, len);
+		aprom_size = p->ldrom_addr;
+	}
+
+	/* a CONFIG of its own decides the LDROM size, whatever the image */
+	if (p->cfg_in_len) {
+		uint32_t ldrom_size;
+
+		memset(p->cfg, 0xff, CFG_FLASH_LEN);
+		memcpy(p->cfg, p->cfg_in, p->cfg_in_len);
+		p->write_cfg = 1;
+
+		ldrom_size = device_ldrom_size(dev, p->cfg);
+		aprom_size = dev->flash_size - ldrom_size;
+
+		if (p->ldrom_len) {
+			memset(&p->image[p->ldrom_addr], 0xff, p->ldrom_len);
+			p->ldrom_addr = aprom_size;
+			p->ldrom_len = p->ldrom_in_len < ldrom_size ? p->ldrom_in_len : ldrom_size;
+			memcpy(&p->image[p->ldrom_addr], p->ldrom, p->ldrom_len);
+
+			if (p->ldrom_len < p->ldrom_in_len)
+				fprintf(stderr, "LDROM image truncated to the %d bytes set in CONFIG\n",
+					ldrom_size);
+		}
+	}
+
+	p->aprom_len = p->aprom_in_len < aprom_size ? p->aprom_in_len : aprom_size;
+	memcpy(&p->image[APROM_FLASH_ADDR], p->aprom, p->aprom_len);
+
+	if (p->aprom_len < p->aprom_in_len) {
+		fprintf(stderr, "APROM image truncated to %d bytes on the %s\n",
+			p->aprom_len, dev->name);
+		p->aprom_crc_valid = 0;
+	}
+
+	return p->aprom_len;
+}
+
+/* read the LDROM and APROM images, either file may be NULL */
+void plan_load(struct flash_plan *p, FILE *file, FILE *file_ldrom)
+{
+	static uint8_t data[FLASH_MAX_SIZE];
+	int len;
+
+	plan_init(p);
+
+	if (file_ldrom && (len = fread(data, 1, LDROM_MAX_SIZE, file_ldrom)) > 0)
+		plan_set_ldrom(p, data, len);
+
+	if (file) {
+		len = fread(data, 1, FLASH_MAX_SIZE, file);
+		plan_set_aprom(p, data, len);
+	}
 }
 
+/* recovery from verify failures and lost ICP sync */
+enum retry_policy {
+	RETRY_NONE,
+	RETRY_PAGE,
+	RETRY_IMAGE,
+};
+
+static const char *retry_names[] = {
+	[RETRY_NONE]	= "none",
+	[RETRY_PAGE]	= "page",
+	[RETRY_IMAGE]	= "image",
+};
+
+enum retry_policy retry_policy = RETRY_PAGE;
+int retry_max = 3;
+
+/* leave and re-enter ICP mode, e.g. after a missed clock edge */
+uint16_t icp_resync(void)
+{
+	run_stats->rec.resyncs++;
+	icp_exit();
+	icp_init();
+
+	return icp_read_device_id();
+}
+
+/* read the ID again before paying for a re-entry, it may just be a glitch */
+uint16_t icp_check_sync(void)
+{
+	uint16_t devid = icp_read_device_id();
+
+	return device_find(devid) ? devid : icp_resync();
+}
+
+int recover_pages(struct flash_plan *p, uint8_t *data, uint8_t *bad_pages)
+{
+	uint32_t page_size = p->dev->page_size;
+	int bad = 0;
+
+	for (int page = 0; page < p->dev->flash_size / page_size; page++) {
+		uint32_t addr = page * page_size;
+		uint32_t len = page_size;
+
+		if (!bad_pages[page])
+			continue;
+
+		/* read again first, a glitch on DAT must not cost an erase */
+		icp_read_flash(addr, page_size, &data[addr]);
+		run_stats->rec.pages_reread++;
+		run_stats->rec.bytes += page_size;
+
+		if (!memcmp(&p->image[addr], &data[addr], page_size)) {
+			run_stats->rec.read_glitches++;
+			bad_pages[page] = 0;
+			continue;
+		}
+
+		/* erased bytes at the end of the page need no programming */
+		while (len && p->image[addr + len - 1] == 0xff)
+			len--;
+
+		icp_page_erase(addr);
+		if (len)
+			icp_write_flash(addr, len, &p->image[addr]);
+		icp_read_flash(addr, page_size, &data[addr]);
+		run_stats->rec.pages_reprogrammed++;
+		run_stats->rec.bytes += len + page_size;
+
+		bad_pages[page] = !!memcmp(&p->image[addr], &data[addr], page_size);
+		bad += bad_pages[page];
+	}
+
+	return bad;
+}
+
+int recover_image(struct flash_plan *p, uint8_t *data, uint8_t *bad_pages)
+{
+	icp_mass_erase();
+	run_stats->rec.bytes += plan_program(p);
+	icp_read_flash(APROM_FLASH_ADDR, p->dev->flash_size, data);
+	run_stats->rec.bytes += p->dev->flash_size;
+	run_stats->rec.images_reprogrammed++;
+
+	return plan_compare(p, data, bad_pages);
+}
+
+static const char *phase_names[PHASE_NUM] = {
+	[PHASE_GPIO_SETUP]	= "gpio_setup",
+	[PHASE_ICP_ENTRY]	= "icp_entry",
+	[PHASE_UART_SETUP]	= "uart_setup",
+	[PHASE_ISP_CONNECT]	= "isp_connect",
+	[PHASE_ID_READ]		= "id_read",
+	[PHASE_ERASE]		= "erase",
+	[PHASE_PROGRAM]		= "program",
+	[PHASE_VERIFY]		= "verify",
+	[PHASE_READ]		= "read",
+	[PHASE_RECOVER]		= "recover",
+	[PHASE_EXIT]		= "exit",
+};
+
+/* the command line's, libnuvoprog switches to the session's on each call */
+static struct run_stats main_stats;
+__thread struct run_stats *run_stats = &main_stats;
+
+void stats_reset(void)
+{
+	memset(run_stats, 0, sizeof(*run_stats));
+	run_stats->run_start = time_ns();
+}
+
+void stats_begin(void)
+{
+	run_stats->phase_start = time_ns();
+}
+
+void stats_end(enum stats_phase phase, uint32_t bytes)
+{
+	run_stats->phase[phase].ns += time_ns() - run_stats->phase_start;
+	run_stats->phase[phase].bytes += bytes;
+}
+
+void stats_print_json(FILE *f, const char *status, uint16_t devid, const struct isp_stats *isp_stats)
+{
+	const struct phase_stats *stats = run_stats->phase;
+	const struct recovery_stats *rec = &run_stats->rec;
+	const struct hybrid_stats *hybrid = &run_stats->hybrid;
+
+	fprintf(f, "{\n\t\"status\": \"%s\",\n", status);
+	fprintf(f, "\t\"device_id\": \"0x%04x\",\n", devid);
+	fprintf(f, "\t\"backend\": \"%s\",\n", isp_only ? "uart" : pgm->name);
+	fprintf(f, "\t\"clock\": \"%s\",\n", !isp_only && pgm->clock_ns ? "virtual" : "monotonic");
+	fprintf(f, "\t\"total_s\": %.6f,\n", (time_ns() - run_stats->run_start) / 1e9);
+	if (!isp_only)
+		pgm_counters_print_json(f);
+	fprintf(f, "\t\"phases\": {\n");
+
+	for (int i = 0; i < PHASE_NUM; i++) {
+		double secs = stats[i].ns / 1e9;
+		double rate = secs > 0 ? stats[i].bytes / secs : 0;
+
+		fprintf(f, "\t\t\"%s\": { \"time_s\": %.6f, \"bytes\": %u, "
+			"\"bytes_per_s\": %.1f }%s\n", phase_names[i], secs,
+			stats[i].bytes, rate, i < PHASE_NUM - 1 ? "," : "");
+	}
+
+	fprintf(f, "\t},\n");
+	fprintf(f, "\t\"recovery\": {\n");
+	fprintf(f, "\t\t\"policy\": \"%s\",\n", retry_names[retry_policy]);
+	fprintf(f, "\t\t\"attempts\": %d,\n", rec->attempts);
+	fprintf(f, "\t\t\"resyncs\": %d,\n", rec->resyncs);
+	fprintf(f, "\t\t\"pages_reread\": %d,\n", rec->pages_reread);
+	fprintf(f, "\t\t\"read_glitches\": %d,\n", rec->read_glitches);
+	fprintf(f, "\t\t\"pages_reprogrammed\": %d,\n", rec->pages_reprogrammed);
+	fprintf(f, "\t\t\"images_reprogrammed\": %d\n", rec->images_reprogrammed);
+	fprintf(f, "\t}%s\n", hybrid->aprom_transport || isp_stats->packets ? "," : "");
+
+	if (hybrid->aprom_transport) {
+		fprintf(f, "\t\"hybrid\": {\n");
+		fprintf(f, "\t\t\"aprom_transport\": \"%s\",\n", hybrid->aprom_transport);
+		fprintf(f, "\t\t\"icp_estimate_s\": %.6f,\n", hybrid->icp_estimate_ns / 1e9);
+		fprintf(f, "\t\t\"isp_estimate_s\": %.6f\n", hybrid->isp_estimate_ns == UINT64_MAX ?
+			-1.0 : hybrid->isp_estimate_ns / 1e9);
+		fprintf(f, "\t}%s\n", isp_stats->packets ? "," : "");
+	}
+
+	if (isp_stats->packets) {
+		fprintf(f, "\t\"isp\": {\n");
+		fprintf(f, "\t\t\"packets\": %u,\n", isp_stats->packets);
+		fprintf(f, "\t\t\"retransmits\": %u,\n", isp_stats->retransmits);
+		fprintf(f, "\t\t\"checksum_errors\": %u,\n", isp_stats->checksum_errors);
+		fprintf(f, "\t\t\"crc_checks\": %u,\n", isp_stats->crc_checks);
+		fprintf(f, "\t\t\"unchanged\": %s,\n", isp_stats->unchanged ? "true" : "false");
+		fprintf(f, "\t\t\"rtt_avg_ms\": %.3f,\n", isp_stats->packets ?
+			isp_stats->rtt_ns / 1e6 / isp_stats->packets : 0);
+		fprintf(f, "\t\t\"rtt_max_ms\": %.3f\n", isp_stats->rtt_max_ns / 1e6);
+		fprintf(f, "\t}\n");
+	}
+
+	fprintf(f, "}\n");
+}
+
+/* read back and compare against the plan, recovering per the retry policy */
+const char *icp_verify(struct flash_plan *plan, uint8_t *read_data)
+{
+	const char *status = "ok";
+	uint8_t bad_pages[MAX_PAGES];
+
+	stats_begin();
+	icp_read_flash(APROM_FLASH_ADDR, plan->dev->flash_size, read_data);
+	stats_end(PHASE_VERIFY, plan->dev->flash_size);
+
+	int bad = plan_compare(plan, read_data, bad_pages);
+
+	if (bad && retry_policy != RETRY_NONE) {
+		fprintf(stderr, "%d pages failed verification, %s retry\n",
+			bad, retry_names[retry_policy]);
+
+		stats_begin();
+		while (bad && run_stats->rec.attempts < retry_max) {
+			run_stats->rec.attempts++;
+
+			/* make sure the target is still in sync before touching flash */
+			if (icp_check_sync() != plan->dev->devid) {
+				status = "target_lost";
+				break;
+			}
+
+			if (retry_policy == RETRY_PAGE)
+				bad = recover_pages(plan, read_data, bad_pages);
+			else
+				bad = recover_image(plan, read_data, bad_pages);
+		}
+		stats_end(PHASE_RECOVER, run_stats->rec.bytes);
+	}
+
+	if (!strcmp(status, "target_lost"))
+		fprintf(stderr, "\nLost connection to target!\n");
+	else if (bad) {
+		fprintf(stderr, "\nError when verifying flash! (%d bad pages)\n", bad);
+		status = "verify_failed";
+	} else
+		fprintf(stderr, "\nEntire Flash verified successfully!\n");
+
+	/* matching content does not mean the flash was treated right */
+	if (!strcmp(status, "ok") && pgm->violations && pgm->violations()) {
+		fprintf(stderr, "Target flash was programmed without an erase!\n");
+		status = "flash_violation";
+	}
+
+	return status;
+}
+
+/* program or read the flash through ICP, returns the status or NULL */
+const char *run_icp(struct flash_plan *plan, int write, FILE *file, uint16_t *devid)
+{
+	const char *status = "ok";
+	const struct nuvo_device *dev;
+	uint8_t read_data[FLASH_MAX_SIZE];
+
+	memset(read_data, 0xff, sizeof(read_data));
+
+	stats_begin();
+	if (pgm_init() < 0)
+		return NULL;
+	stats_end(PHASE_GPIO_SETUP, 0);
+
+	stats_begin();
+	icp_init();
+	stats_end(PHASE_ICP_ENTRY, 0);
+
+	stats_begin();
+	*devid = icp_read_device_id();
+	stats_end(PHASE_ID_READ, 2);
+
+	dev = device_find(*devid);
+
+	if (!dev && retry_policy != RETRY_NONE) {
+		stats_begin();
+		while (!dev && run_stats->rec.attempts < retry_max) {
+			run_stats->rec.attempts++;
+			*devid = icp_check_sync();
+			dev = device_find(*devid);
+		}
+		stats_end(PHASE_RECOVER, 0);
+	}
+
+	if (dev)
+		fprintf(stderr, "Found %s\n", dev->name);
+	else {
+		fprintf(stderr, "Unknown Device ID: 0x%04x\n", *devid);
+		status = "unknown_device";
+		goto out;
+	}
+
+	icp_dev = dev;
+
+	if (write && plan->devid && plan->devid != dev->devid) {
+		fprintf(stderr, "Image is for device ID 0x%04x, not the %s\n", plan->devid, dev->name);
+		status = "wrong_device";
+		goto out;
+	}
+
+	stats_begin();
+	uint8_t cid = icp_read_cid();
+	uint32_t uid = icp_read_uid();
+	uint32_t ucid = icp_read_ucid();
+	stats_end(PHASE_ID_READ, 1 + 3 + 4);
+
+	fprintf(stderr,"CID\t\t\t0x%02x\n", cid);
+	fprintf(stderr,"UID\t\t\t0x%06x\n", uid);
+	fprintf(stderr,"UCID\t\t\t0x%08x\n", ucid);
+
+	if (cid == 0xff) {
+		fprintf(stderr, "Device is locked%s\n", write ?
+			", mass erase will unlock it" : ", flash content is not readable");
+	}
+
+	/* Erase entire flash */
+	if (write) {
+		plan_layout(plan, dev);
+
+		stats_begin();
+		icp_mass_erase();
+		stats_end(PHASE_ERASE, 0);
+
+		stats_begin();
+		uint32_t programmed = plan_program(plan);
+		stats_end(PHASE_PROGRAM, programmed);
+	}
+
+	stats_begin();
+	icp_dump_config(dev);
+	stats_end(PHASE_ID_READ, dev->cfg_len);
+
+	if (write)
+		status = icp_verify(plan, read_data);
+	else {
+		stats_begin();
+		icp_read_flash(APROM_FLASH_ADDR, dev->flash_size, read_data);
+		stats_end(PHASE_READ, dev->flash_size);
+
+		/* save flash content to file */
+		if (fwrite(read_data, 1, dev->flash_size, file) != dev->flash_size) {
+			fprintf(stderr, "Error writing file!\n");
+			status = "file_error";
+		} else
+			fprintf(stderr, "\nFlash successfully read.\n");
+	}
+
+out:
+	stats_begin();
+	icp_exit();
+	pgm_deinit();
+	stats_end(PHASE_EXIT, 0);
+
+	return status;
+}
+
+/* update APROM over ISP, skipped and verified by CRC-32 if it is nuvoboot */
+const char *isp_program_plan(struct isp_link *l, struct flash_plan *plan)
+{
+	const uint8_t *aprom = &plan->image[APROM_FLASH_ADDR];
+	const char *status = "ok";
+	struct isp_caps caps;
+	uint32_t crc, image_crc;
+	int ret, have_crc;
+
+	/* a package comes with it */
+	image_crc = plan->aprom_crc_valid ? plan->aprom_crc : crc32(aprom, plan->aprom_len);
+
+	stats_begin();
+	have_crc = !isp_get_caps(l, &caps) && (caps.features & ISP_CAP_CRC32);
+
+	if (have_crc && !isp_crc32(l, APROM_FLASH_ADDR, plan->aprom_len, &crc) &&
+	    crc == image_crc) {
+		stats_end(PHASE_VERIFY, plan->aprom_len);
+		fprintf(stderr, "APROM already matches the image, skipping update\n");
+		l->stats.unchanged = 1;
+		return status;
+	}
+	stats_end(PHASE_VERIFY, 0);
+
+	/* every reply echoes the checksum of the packet */
+	stats_begin();
+	ret = isp_update_aprom(l, APROM_FLASH_ADDR, plan->aprom_len, aprom);
+	stats_end(PHASE_PROGRAM, plan->aprom_len);
+
+	if (l->stats.checksum_errors) {
+		fprintf(stderr, "\nError when verifying flash!\n");
+		return "verify_failed";
+	} else if (ret < 0)
+		return "no_response";
+
+	fprintf(stderr, "Programmed APROM (%d bytes)\n", plan->aprom_len);
+
+	if (!have_crc) {
+		fprintf(stderr, "All packets verified\n");
+		return status;
+	}
+
+	stats_begin();
+	ret = isp_crc32(l, APROM_FLASH_ADDR, plan->aprom_len, &crc);
+	stats_end(PHASE_VERIFY, plan->aprom_len);
+
+	if (ret < 0)
+		status = "no_response";
+	else if (crc != image_crc) {
+		fprintf(stderr, "\nAPROM CRC-32 mismatch: 0x%08x, expected 0x%08x\n",
+			crc, image_crc);
+		status = "verify_failed";
+	} else
+		fprintf(stderr, "APROM CRC-32 0x%08x verified\n", crc);
+
+	return status;
+}
+
+/* the UART link of run_isp() and run_hybrid() */
+struct isp_link isp = { .fd = -1 };
+
+/* program APROM through the LDROM bootloader, returns the status or NULL */
+const char *run_isp(struct flash_plan *plan, const char *port, int baud, uint16_t *devid)
+{
+	const struct nuvo_device *dev;
+	const char *status = "ok";
+	uint8_t cfg[CFG_FLASH_LEN];
+	int ret;
+
+	stats_begin();
+	if (isp_open(&isp, port, baud) < 0)
+		return NULL;
+	stats_end(PHASE_UART_SETUP, 0);
+
+	stats_begin();
+	ret = isp_connect(&isp, 0);
+	stats_end(PHASE_ISP_CONNECT, 0);
+
+	if (ret < 0) {
+		status = "no_response";
+		goto out;
+	}
+
+	stats_begin();
+	*devid = isp_read_device_id(&isp);
+	stats_end(PHASE_ID_READ, 2);
+
+	if ((dev = device_find(*devid)))
+		fprintf(stderr, "Found %s\n", dev->name);
+	else {
+		fprintf(stderr, "Unknown Device ID: 0x%04x\n", *devid);
+		status = "unknown_device";
+		goto out;
+	}
+
+	if (plan->devid && plan->devid != dev->devid) {
+		fprintf(stderr, "Image is for device ID 0x%04x, not the %s\n", plan->devid, dev->name);
+		status = "wrong_device";
+		goto out;
+	}
+
+	stats_begin();
+	ret = isp_read_config(&isp, cfg);
+	stats_end(PHASE_ID_READ, CFG_FLASH_LEN);
+
+	if (ret < 0) {
+		status = "no_response";
+		goto out;
+	}
+
+	/* the LDROM the bootloader runs from stays, its size in CONFIG limits APROM */
+	plan_set_config(plan, cfg, dev->cfg_len);
+	if (plan_layout(plan, dev) < plan->aprom_in_len) {
+		fprintf(stderr, "APROM image too big for the %d bytes next to the LDROM\n",
+			dev->flash_size - device_ldrom_size(dev, cfg));
+		status = "too_big";
+		goto out;
+	}
+
+	status = isp_program_plan(&isp, plan);
+
+out:
+	stats_begin();
+	if (!strcmp(status, "ok"))
+		isp_run_aprom(&isp);
+	isp_close(&isp);
+	stats_end(PHASE_EXIT, 0);
+
+	return status;
+}
+
+/*
+ * LDROM and CONFIG over ICP, then APROM over whichever transport is
+ * projected to finish first from the rates measured so far
+ */
+const char *run_hybrid(struct flash_plan *plan, const char *port, int baud, uint16_t *devid)
+{
+	static struct flash_plan stage;
+	struct phase_stats *stats = run_stats->phase;
+	struct hybrid_stats *hybrid = &run_stats->hybrid;
+	uint8_t read_data[FLASH_MAX_SIZE];
+	const char *status;
+	int ret;
+
+	/* first pass: LDROM and CONFIG, APROM stays erased */
+	stage = *plan;
+	stage.aprom_in_len = 0;
+
+	status = run_icp(&stage, 1, NULL, devid);
+	if (!status || strcmp(status, "ok") || !plan_layout(plan, stage.dev))
+		return status;
+
+	/* nothing to measure ICP by, and no bootloader to ask over ISP */
+	if (!stats[PHASE_PROGRAM].bytes) {
+		fprintf(stderr, "No LDROM written, APROM over ICP\n");
+		hybrid->aprom_transport = "icp";
+		hybrid->isp_estimate_ns = UINT64_MAX;
+		goto icp;
+	}
+
+	/* ICP: per byte cost of the LDROM just written, plus entry and verify */
+	uint64_t icp_byte_ns = stats[PHASE_PROGRAM].ns / stats[PHASE_PROGRAM].bytes;
+	hybrid->icp_estimate_ns = plan->aprom_len * icp_byte_ns +
+				 stats[PHASE_GPIO_SETUP].ns + stats[PHASE_ICP_ENTRY].ns +
+				 stats[PHASE_VERIFY].ns;
+
+	/* ISP: round trips to the bootloader that was just programmed */
+	uart_time_begin();
+	stats_begin();
+	ret = isp_open(&isp, port, baud);
+	stats_end(PHASE_UART_SETUP, 0);
+
+	if (!ret) {
+		stats_begin();
+		ret = isp_connect(&isp, ISP_LISTEN_TIMEOUT);
+		if (!ret && isp_read_device_id(&isp) == plan->dev->devid)
+			fprintf(stderr, "Bootloader version 0x%02x\n", isp_read_fw_version(&isp));
+		else
+			ret = -ENODEV;
+		stats_end(PHASE_ISP_CONNECT, 0);
+	}
+
+	hybrid->isp_estimate_ns = ret < 0 ? UINT64_MAX : isp_estimate_ns(&isp, plan->aprom_len);
+
+	if (hybrid->isp_estimate_ns < hybrid->icp_estimate_ns) {
+		hybrid->aprom_transport = "isp";
+		fprintf(stderr, "APROM over ISP (projected %.3f s, ICP %.3f s)\n",
+			hybrid->isp_estimate_ns / 1e9, hybrid->icp_estimate_ns / 1e9);
+
+		status = isp_program_plan(&isp, plan);
+		if (!strcmp(status, "ok"))
+			isp_run_aprom(&isp);
+
+		isp_close(&isp);
+		uart_time_end();
+		return status;
+	}
+
+	isp_close(&isp);
+	uart_time_end();
+
+	hybrid->aprom_transport = "icp";
+	if (ret < 0)
+		fprintf(stderr, "No ISP link to the bootloader, APROM over ICP\n");
+	else
+		fprintf(stderr, "APROM over ICP (projected %.3f s, ISP %.3f s)\n",
+			hybrid->icp_estimate_ns / 1e9, hybrid->isp_estimate_ns / 1e9);
+
+icp:
+	/* second pass: APROM only, the mass erase already cleared it */
+	stage = *plan;
+	stage.write_cfg = 0;
+	stage.ldrom_len = 0;
+
+	stats_begin();
+	if (pgm_init() < 0)
+		return NULL;
+	stats_end(PHASE_GPIO_SETUP, 0);
+
+	stats_begin();
+	icp_init();
+	stats_end(PHASE_ICP_ENTRY, 0);
+
+	stats_begin();
+	uint32_t programmed = plan_program(&stage);
+	stats_end(PHASE_PROGRAM, programmed);
+
+	status = icp_verify(plan, read_data);
+
+	stats_begin();
+	icp_exit();
+	pgm_deinit();
+	stats_end(PHASE_EXIT, 0);
+
+	return status;
+}
+
+#ifndef NUVOPROG_LIB
 void usage(void)
 {
 	fprintf(stderr,
@@ -316,8 +1381,28 @@ void usage(void)
 		"written by Steve Markgraf <steve@steve-m.de>\n\n"
 		"Usage:\n"
 		"\t[-r <filename> read entire flash to file]\n"
-		"\t[-w <filename> write file to APROM/entire flash (if LDROM is disabled)]\n"
+		"\t[-w <filename> write file to APROM/entire flash (if LDROM is disabled),\n"
+		"\t     or all segments of a package built with nuvopkg.py]\n"
 		"\t[-l <filename> write file to LDROM, enable LDROM, enable boot from LDROM]\n"
+		"\t[-s, --stats print per-phase run statistics as JSON to stdout]\n"
+		"\t[-c, --counters print GPIO operation counters and delay histograms on exit]\n"
+		"\t[-t, --trace <filename> write a VCD waveform of all ICP line activity]\n"
+		"\t[-b, --backend <name> GPIO backend: gpiod (default) or sim (simulated target)]\n"
+		"\t[-m, --sim-cost <model>[,param=value...] cost model of the simulated target's\n"
+		"\t     virtual clock: gpiod (default), gpiomem or ideal; params: ioctl_ns, reg_ns,\n"
+		"\t     sleep_ns, op_ioctls, op_regs, dir_ioctls, dir_regs]\n"
+		"\t[-f, --sim-fault <fault>[,fault...] inject faults into the simulated target:\n"
+		"\t     flip=<probability> (DAT reads), drop=<probability> (CLK edges),\n"
+		"\t     page=<addr>[:<passes>] (program failure), locked, pull=<bytes>, seed=<n>]\n"
+		"\t[-d, --sim-device <part> part number of the simulated target, default N76E003]\n"
+		"\t[-R, --retry <none|page|image>[:<attempts>] recovery from verify failures\n"
+		"\t     and lost sync, default page:3]\n"
+		"\t[-i, --isp <tty> write APROM through the UART ISP bootloader instead of ICP;\n"
+		"\t     with -l the bootloader is written over ICP first and APROM goes over\n"
+		"\t     whichever link is projected to be faster]\n"
+		"\t[-B, --baud <rate> baud rate for ISP, default 115200]\n"
+		"\t[-C, --cache <dir> keep the images prepared in this local cache, shared with\n"
+		"\t     nuvoispy; default $NUVOPROG_CACHE, if set]\n"
 		"\nPinout:\n\n"
 		"                           40-pin header J8\n"
 		" connect 3.3V of MCU ->    3V3  (1) (2)  5V\n"
@@ -334,18 +1419,33 @@ void usage(void)
 
 int main(int argc, char *argv[])
 {
-	int opt;
-	int write_aprom = 0, write_ldrom = 0;
-	int aprom_program_size = 0, ldrom_program_size = 0;
-	char *filename = NULL, *filename_ldrom = NULL;
+	int opt, ret, have_pkg = 0;
+	int write_aprom = 0, write_ldrom = 0, print_stats = 0, print_counters = 0;
+	int baud = 115200;
+	const char *status;
+	uint16_t devid = 0;
+	char *filename = NULL, *filename_ldrom = NULL, *filename_trace = NULL;
+	char *isp_port = NULL, *cache_dir = NULL;
 	FILE *file = NULL, *file_ldrom = NULL;
-	uint8_t read_data[FLASH_SIZE], write_data[FLASH_SIZE], ldrom_data[LDROM_MAX_SIZE];
-
-	memset(read_data, 0xff, sizeof(read_data));
-	memset(write_data, 0xff, sizeof(write_data));
-	memset(ldrom_data, 0xff, sizeof(ldrom_data));
-
-	while ((opt = getopt(argc, argv, "r:w:l:")) != -1) {
+	static struct flash_plan plan;
+	struct pkg pkg;
+
+	static const struct option long_opts[] = {
+		{ "stats", no_argument, NULL, 's' },
+		{ "counters", no_argument, NULL, 'c' },
+		{ "trace", required_argument, NULL, 't' },
+		{ "backend", required_argument, NULL, 'b' },
+		{ "sim-cost", required_argument, NULL, 'm' },
+		{ "sim-fault", required_argument, NULL, 'f' },
+		{ "sim-device", required_argument, NULL, 'd' },
+		{ "retry", required_argument, NULL, 'R' },
+		{ "isp", required_argument, NULL, 'i' },
+		{ "baud", required_argument, NULL, 'B' },
+		{ "cache", required_argument, NULL, 'C' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	while ((opt = getopt_long(argc, argv, "r:w:l:sct:b:m:f:d:R:i:B:C:", long_opts, NULL)) != -1) {
 		switch (opt) {
 		case 'r':
 			filename = optarg;
@@ -358,6 +1458,56 @@ int main(int argc, char *argv[])
 			filename_ldrom = optarg;
 			write_ldrom = 1;
 			break;
+		case 's':
+			print_stats = 1;
+			break;
+		case 'c':
+			print_counters = 1;
+			pgm_timing = 1;
+			break;
+		case 't':
+			filename_trace = optarg;
+			trace_enabled = 1;
+			break;
+		case 'b':
+			pgm = pgm_find(optarg);
+			if (!pgm) {
+				fprintf(stderr, "Unknown backend: %s\n\n", optarg);
+				usage();
+			}
+			break;
+		case 'm':
+			if (sim_set_cost_model(optarg) < 0)
+				usage();
+			break;
+		case 'f':
+			if (sim_set_faults(optarg) < 0)
+				usage();
+			break;
+		case 'd':
+			if (sim_set_device(optarg) < 0)
+				usage();
+			break;
+		case 'R':
+			for (retry_policy = RETRY_NONE; retry_policy <= RETRY_IMAGE; retry_policy++) {
+				if (!strncmp(optarg, retry_names[retry_policy],
+					     strlen(retry_names[retry_policy])))
+					break;
+			}
+			if (retry_policy > RETRY_IMAGE)
+				usage();
+			if (strchr(optarg, ':'))
+				retry_max = atoi(strchr(optarg, ':') + 1);
+			break;
+		case 'i':
+			isp_port = optarg;
+			break;
+		case 'B':
+			baud = atoi(optarg);
+			break;
+		case 'C':
+			cache_dir = optarg;
+			break;
 		case 'h':
 		default:
 			usage();
@@ -365,6 +1515,12 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	/* the stock bootloader can only update APROM, LDROM goes over ICP first */
+	if (isp_port && !write_aprom) {
+		fprintf(stderr, "ISP mode only supports writing APROM (-w)\n\n");
+		usage();
+	}
+
 	if (filename)
 		file = fopen(filename, write_aprom ? "rb" : "wb");
 
@@ -377,84 +1533,66 @@ int main(int argc, char *argv[])
 		goto err;
 	}
 
-	if (pgm_init() < 0)
-		goto err;
+	if (!cache_dir)
+		cache_dir = getenv("NUVOPROG_CACHE");
 
-	icp_init();
-
-	uint16_t devid = icp_read_device_id();
-
-	if (devid == N76E003_DEVID)
-		fprintf(stderr, "Found N76E003\n");
-	else {
-		fprintf(stderr, "Unknown Device ID: 0x%04x\n", devid);
-		goto out;
+	if ((write_aprom || write_ldrom) && cache_dir) {
+		ret = cache_open(&pkg, cache_dir, write_aprom ? filename : NULL, filename_ldrom);
+		if (ret < 0)
+			fprintf(stderr, "Image cache %s: %s, loading directly\n", cache_dir, strerror(-ret));
+		have_pkg = !ret;
 	}
 
-	uint8_t cid = icp_read_cid();
-
-	fprintf(stderr,"CID\t\t\t0x%02x\n", cid);
-	fprintf(stderr,"UID\t\t\t0x%06x\n", icp_read_uid());
-	fprintf(stderr,"UCID\t\t\t0x%08x\n", icp_read_ucid());
-
-	/* Erase entire flash */
-	if (write_aprom || write_ldrom)
-		icp_mass_erase();
+	if (!have_pkg && write_aprom && !pkg_open(&pkg, filename)) {
+		if (file_ldrom) {
+			fprintf(stderr, "LDROM comes from the package, -l can't be used with it\n\n");
+			usage();
+		}
+		have_pkg = 1;
+	}
 
-	int chosen_ldrom_sz = 0;
+	if (have_pkg) {
+		ret = plan_load_pkg(&plan, &pkg);
+		pkg_close(&pkg);
 
-	if (write_ldrom) {
-		ldrom_program_size = fread(ldrom_data, 1, LDROM_MAX_SIZE, file_ldrom);
-		uint8_t chosen_ldrom_sz_kb = ((ldrom_program_size - 1) / 1024) + 1;
-		uint8_t ldrom_sz_cfg = (7 - chosen_ldrom_sz_kb) & 0x7;
-		chosen_ldrom_sz = chosen_ldrom_sz_kb * 1024;
+		if (ret < 0) {
+			fprintf(stderr, "Package %s does not fit any part\n", filename);
+			goto err;
+		}
 
-		/* configure LDROM size and enable boot from LDROM */
-		uint8_t cfg[CFG_FLASH_LEN] = { 0x7f, 0xf8 | ldrom_sz_cfg, 0xff, 0xff, 0xff };
-		icp_write_flash(CFG_FLASH_ADDR, CFG_FLASH_LEN, cfg);
+		/* LDROM and CONFIG always go over ICP */
+		write_ldrom = plan.ldrom_in_len || plan.cfg_in_len;
+	} else if (write_aprom || write_ldrom)
+		plan_load(&plan, write_aprom ? file : NULL, file_ldrom);
 
-		/* program LDROM */
-		icp_write_flash(FLASH_SIZE - chosen_ldrom_sz, ldrom_program_size, ldrom_data);
-		fprintf(stderr, "Programmed LDROM (%d bytes)\n", ldrom_program_size);
-	}
+	if (isp_port && !write_ldrom)
+		isp_only = 1;
 
-	if (write_aprom) {
-		int aprom_size = FLASH_SIZE - chosen_ldrom_sz;
-		aprom_program_size = fread(write_data, 1, aprom_size, file);
+	stats_reset();
 
-		/* program flash */
-		icp_write_flash(APROM_FLASH_ADDR, aprom_program_size, write_data);
-		fprintf(stderr, "Programmed APROM (%d bytes)\n", aprom_program_size);
-	}
+	if (isp_port && write_ldrom)
+		status = run_hybrid(&plan, isp_port, baud, &devid);
+	else if (isp_port)
+		status = run_isp(&plan, isp_port, baud, &devid);
+	else
+		status = run_icp(&plan, write_aprom || write_ldrom, file, &devid);
 
-	icp_dump_config();
+	if (!status)
+		goto err;
 
-	if (write_aprom || write_ldrom) {
-		/* verify flash */
-		icp_read_flash(APROM_FLASH_ADDR, FLASH_SIZE, read_data);
+	if (filename_trace)
+		trace_write_vcd(filename_trace);
 
-		/* copy the LDROM content in the buffer of the entire flash for
-		 * verification */
-		memcpy(&write_data[FLASH_SIZE - chosen_ldrom_sz], ldrom_data, chosen_ldrom_sz);
-		if (memcmp(write_data, read_data, FLASH_SIZE))
-			fprintf(stderr, "\nError when verifying flash!\n");
-		else
-			fprintf(stderr, "\nEntire Flash verified successfully!\n");
-	} else {
-		icp_read_flash(APROM_FLASH_ADDR, FLASH_SIZE, read_data);
+	if (print_counters)
+		pgm_counters_print(stderr);
 
-		/* save flash content to file */
-		if (fwrite(read_data, 1, FLASH_SIZE, file) != FLASH_SIZE)
-			fprintf(stderr, "Error writing file!\n");
-		else
-			fprintf(stderr, "\nFlash successfully read.\n");
-	}
+	if (print_stats)
+		stats_print_json(stdout, status, devid, &isp.stats);
 
-out:
-	icp_exit();
-	pgm_deinit();
-	return 0;
+	/* a run that did not end "ok" fails, whether or not it got far */
+	return !!strcmp(status, "ok");
 
 err:
 	return 1;
 }
+#endif
@@ -0,0 +1,376 @@
+/*
+ * nuvoicp, a RPi ICP flasher for the Nuvoton N76E003
+ * https://github.com/steve-m/N76E003-playground
+ *
+ * Copyright (c) 2021 Steve Markgraf <steve@steve-m.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef NUVOICP_H
+#define NUVOICP_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define N76E003_DEVID	0x3650
+
+/* the largest part in the device table, for buffers */
+#define FLASH_MAX_SIZE	(32 * 1024)
+#define LDROM_MAX_SIZE	(4 * 1024)
+
+/* smallest erase page of any part */
+#define PAGE_SIZE	128
+
+#define APROM_FLASH_ADDR	0x0
+#define CFG_FLASH_ADDR		0x30000
+#define CFG_FLASH_LEN		5	/* at most, see nuvo_device.cfg_len */
+
+#define CMD_READ_UID		0x04
+#define CMD_READ_CID		0x0b
+#define CMD_READ_DEVICE_ID	0x0c
+#define CMD_READ_FLASH		0x00
+#define CMD_WRITE_FLASH		0x21
+#define CMD_MASS_ERASE		0x26
+#define CMD_PAGE_ERASE		0x22
+
+/* one Nuvoton 8051 part, see devices.c */
+struct nuvo_device {
+	uint16_t devid;
+	const char *name;		/* part numbers, separated by '/' */
+	uint32_t flash_size;		/* APROM and LDROM */
+	uint32_t page_size;
+	uint32_t ldrom_max;		/* at the end of the flash, in 1 KB steps */
+	const uint8_t *ldrom_kb;	/* LDROM size for each CONFIG1 LDSIZE value */
+	uint8_t cfg_len;
+	/* ICP delays in us, with the final DAT level set and after the CLK edge */
+	uint32_t prog_us[2];
+	uint32_t page_erase_us[2];
+	uint32_t mass_erase_us[2];
+};
+
+extern const struct nuvo_device devices[];
+extern const int num_devices;
+
+const struct nuvo_device *device_find(uint16_t devid);
+const struct nuvo_device *device_find_name(const char *name);
+uint32_t device_ldrom_size(const struct nuvo_device *d, const uint8_t *cfg);
+uint8_t device_ldrom_cfg(const struct nuvo_device *d, uint32_t len);
+
+/* ISP over UART, see isp.c */
+#define ISP_PACKSIZE		64
+#define ISP_LISTEN_TIMEOUT	2000	/* ms to wait for the bootloader after reset */
+
+#define ISP_CMD_UPDATE_APROM	0xa0
+#define ISP_CMD_UPDATE_CONFIG	0xa1
+#define ISP_CMD_READ_CONFIG	0xa2
+#define ISP_CMD_SYNC_PACKNO	0xa4
+#define ISP_CMD_GET_FWVER	0xa6
+#define ISP_CMD_RUN_APROM	0xab
+#define ISP_CMD_CONNECT		0xae
+#define ISP_CMD_GET_DEVICEID	0xb1
+
+/* nuvoboot extensions */
+#define ISP_CMD_GET_CAPS	0xd0
+#define ISP_CMD_CRC32		0xd4
+
+#define ISP_FW_NUVOBOOT		0x80	/* CMD_GET_FWVER flag */
+#define ISP_CAP_CRC32		0x01
+
+struct isp_caps {
+	uint8_t version;
+	uint8_t payload;
+	uint8_t window;
+	uint8_t bauds;
+	uint8_t features;
+};
+
+struct isp_stats {
+	uint32_t packets;
+	uint32_t retransmits;
+	uint32_t checksum_errors;
+	uint32_t crc_checks;
+	int unchanged;		/* APROM already matched, no update */
+	uint64_t rtt_ns;
+	uint64_t rtt_max_ns;
+};
+
+/* one UART connection, independent of any other */
+struct isp_link {
+	int fd;
+	int wire_ms;		/* one packet on the wire, 8N1 */
+	uint16_t seq;
+	struct isp_stats stats;
+	/* progress of isp_update_aprom(), dots on stderr if NULL */
+	void (*progress)(void *arg, uint32_t done, uint32_t total);
+	void *progress_arg;
+};
+
+int isp_open(struct isp_link *l, const char *port, int baud);
+void isp_close(struct isp_link *l);
+uint16_t isp_checksum(const uint8_t *buf, int len);
+int isp_send_cmd(struct isp_link *l, const uint8_t *tx, uint8_t *rx, int timeout_ms);
+int isp_connect(struct isp_link *l, int timeout_ms);
+uint16_t isp_read_device_id(struct isp_link *l);
+uint8_t isp_read_fw_version(struct isp_link *l);
+int isp_get_caps(struct isp_link *l, struct isp_caps *caps);
+int isp_crc32(struct isp_link *l, uint32_t addr, uint32_t len, uint32_t *crc);
+uint32_t crc32(const uint8_t *buf, uint32_t len);
+uint32_t crc32_update(uint32_t crc, const uint8_t *buf, uint32_t len);
+uint64_t isp_estimate_ns(struct isp_link *l, uint32_t len);
+int isp_update_aprom(struct isp_link *l, uint32_t addr, uint32_t len, const uint8_t *data);
+int isp_read_config(struct isp_link *l, uint8_t *cfg);
+void isp_run_aprom(struct isp_link *l);
+
+/* access to the ICP lines, implemented once per backend */
+struct pgm_backend {
+	const char *name;
+	int (*init)(void);
+	void (*deinit)(void);
+	void (*set_dat)(int val);
+	int (*get_dat)(void);
+	void (*set_rst)(int val);
+	void (*set_clk)(int val);
+	void (*dat_dir)(int state);
+	void (*delay)(uint32_t us);
+	uint64_t (*clock_ns)(void);	/* virtual clock, NULL for wall time */
+	uint32_t (*violations)(void);	/* flash rules broken since init, NULL if unknown */
+};
+
+extern const struct pgm_backend pgm_gpiod_backend;
+extern const struct pgm_backend pgm_sim_backend;
+
+int sim_set_cost_model(const char *spec);
+int sim_set_faults(const char *spec);
+int sim_set_device(const char *name);
+
+extern __thread int isp_only;
+uint64_t time_ns(void);
+const struct pgm_backend *pgm_find(const char *name);
+
+extern const struct pgm_backend *pgm;
+
+int pgm_init(void);
+void pgm_deinit(void);
+
+/* the programming engine in nuvoicp.c, used by main() and libnuvoprog */
+#define MAX_PAGES	(FLASH_MAX_SIZE / PAGE_SIZE)
+
+/*
+ * what to program, and the flash content expected afterwards; the
+ * images are given before the part is known, plan_layout() places them
+ */
+struct flash_plan {
+	uint16_t devid;			/* part the images are for, 0 for any */
+	uint8_t aprom[FLASH_MAX_SIZE];
+	uint8_t ldrom[LDROM_MAX_SIZE];
+	uint8_t cfg_in[CFG_FLASH_LEN];
+	uint32_t aprom_in_len, ldrom_in_len, cfg_in_len;
+	uint32_t aprom_crc;		/* CRC-32 of all of aprom, if aprom_crc_valid */
+	int aprom_crc_valid;
+
+	const struct nuvo_device *dev;
+	uint8_t image[FLASH_MAX_SIZE];
+	uint8_t cfg[CFG_FLASH_LEN];
+	int write_cfg;
+	uint32_t aprom_len;
+	uint32_t ldrom_addr, ldrom_len;
+};
+
+void plan_init(struct flash_plan *p);
+void plan_set_ldrom(struct flash_plan *p, const uint8_t *data, uint32_t len);
+void plan_set_aprom(struct flash_plan *p, const uint8_t *data, uint32_t len);
+void plan_set_config(struct flash_plan *p, const uint8_t *data, uint32_t len);
+uint32_t plan_layout(struct flash_plan *p, const struct nuvo_device *dev);
+uint32_t plan_program(struct flash_plan *p);
+
+/* progress of icp_read_flash() and icp_write_flash(), dots on stderr if NULL */
+extern void (*icp_progress)(void *arg, uint32_t done, uint32_t total);
+extern void *icp_progress_arg;
+
+/* the part on the ICP lines, for its timing */
+extern const struct nuvo_device *icp_dev;
+
+void icp_init(void);
+void icp_exit(void);
+void icp_bitsend(uint32_t data, int len);
+uint8_t icp_read_cid(void);
+uint32_t icp_read_device_id(void);
+uint16_t icp_check_sync(void);
+uint32_t icp_read_flash(uint32_t addr, uint32_t len, uint8_t *data);
+void icp_mass_erase(void);
+void icp_dump_config(const struct nuvo_device *dev);
+const char *icp_verify(struct flash_plan *plan, uint8_t *read_data);
+const char *run_icp(struct flash_plan *plan, int write, FILE *file, uint16_t *devid);
+const char *isp_program_plan(struct isp_link *l, struct flash_plan *plan);
+
+/*
+ * firmware package built by nuvoispy/nuvopkg.py, little-endian, used in
+ * place from a read-only mapping, see pkg.c
+ */
+#define PKG_MAGIC	"NVPK"
+#define PKG_VERSION	1
+
+struct pkg_header {
+	char magic[4];
+	uint16_t version;
+	uint16_t devid;			/* 0 for any part */
+	uint16_t page_size;
+	uint16_t num_segments;
+	uint32_t digest;		/* CRC-32 of the data of all segments */
+	uint8_t reserved[12];
+};
+
+struct pkg_segment {
+	uint32_t region;
+	uint32_t len;
+	uint32_t data_offset;		/* page aligned */
+	uint32_t hash_offset;		/* CRC-32 of each page, padded with 0xff */
+	uint32_t crc;			/* CRC-32 of the data, as nuvoboot CMD_CRC32 */
+	uint8_t reserved[12];
+};
+
+#define PKG_APROM	0
+#define PKG_LDROM	1
+#define PKG_CONFIG	2
+
+struct pkg {
+	const uint8_t *map;
+	size_t size;
+	const struct pkg_header *hdr;
+	const struct pkg_segment *segs;
+};
+
+int pkg_open(struct pkg *pkg, const char *filename);
+void pkg_close(struct pkg *pkg);
+const struct pkg_segment *pkg_find(const struct pkg *pkg, uint32_t region);
+int plan_load_pkg(struct flash_plan *p, const struct pkg *pkg);
+
+/* content-addressed cache of packages, see cache.c */
+uint64_t fnv1a64(const void *buf, size_t len, uint64_t hash);
+int cache_open(struct pkg *pkg, const char *dir, const char *aprom, const char *ldrom);
+
+/* run statistics, one entry per programming phase */
+enum stats_phase {
+	PHASE_GPIO_SETUP,
+	PHASE_ICP_ENTRY,
+	PHASE_UART_SETUP,
+	PHASE_ISP_CONNECT,
+	PHASE_ID_READ,
+	PHASE_ERASE,
+	PHASE_PROGRAM,
+	PHASE_VERIFY,
+	PHASE_READ,
+	PHASE_RECOVER,
+	PHASE_EXIT,
+	PHASE_NUM
+};
+
+struct phase_stats {
+	uint64_t ns;
+	uint32_t bytes;
+};
+
+struct recovery_stats {
+	int attempts;
+	int resyncs;
+	int pages_reread;
+	int read_glitches;	/* pages that matched when read again */
+	int pages_reprogrammed;
+	int images_reprogrammed;
+	uint32_t bytes;
+};
+
+/* transport decision of run_hybrid() */
+struct hybrid_stats {
+	uint64_t icp_estimate_ns;
+	uint64_t isp_estimate_ns;
+	const char *aprom_transport;
+};
+
+struct run_stats {
+	struct phase_stats phase[PHASE_NUM];
+	struct recovery_stats rec;
+	struct hybrid_stats hybrid;
+	uint64_t phase_start, run_start;
+};
+
+/* what the calling thread records into, each libnuvoprog session has its own */
+extern __thread struct run_stats *run_stats;
+
+void stats_reset(void);
+void stats_begin(void);
+void stats_end(enum stats_phase phase, uint32_t bytes);
+void stats_print_json(FILE *f, const char *status, uint16_t devid, const struct isp_stats *isp_stats);
+
+/* GPIO operation counters, cheap enough to be always enabled */
+enum pgm_op {
+	PGM_SET_DAT,
+	PGM_GET_DAT,
+	PGM_SET_RST,
+	PGM_SET_CLK,
+	PGM_DAT_DIR,
+	PGM_NUM_OPS
+};
+
+/* log2 latency buckets, from <256 ns up to >=131 us (2^17 ns) */
+#define LAT_BUCKETS	11
+#define LAT_SHIFT	8
+
+struct pgm_counters {
+	uint32_t ioctls;
+	uint32_t dir_switches;
+	uint32_t clk_edges;
+	uint32_t calls[PGM_NUM_OPS];
+	uint32_t latency[PGM_NUM_OPS][LAT_BUCKETS];
+};
+
+/*
+ * Like the delay statistics and the trace they belong to the ICP lines,
+ * which only one run or libnuvoprog session in the process drives
+ */
+extern struct pgm_counters pgm_cnt;
+
+void pgm_counters_reset(void);
+
+/* VCD waveform trace of the ICP lines, only recorded with -t */
+enum trace_sig {
+	TRACE_CLK,
+	TRACE_DAT,
+	TRACE_RST,
+	TRACE_DAT_OE,
+	TRACE_DAT_IN,
+	TRACE_TGT_DAT,
+	TRACE_NUM_SIGS
+};
+
+#define TRACE_Z		-2	/* line not driven */
+
+extern int trace_enabled;
+void trace_record(enum trace_sig sig, char val);
+
+/* a single predictable branch per pgm_* call when tracing is disabled */
+static inline void trace(enum trace_sig sig, int val)
+{
+	if (trace_enabled)
+		trace_record(sig, val == TRACE_Z ? 'z' : val < 0 ? 'x' : '0' + val);
+}
+
+#endif
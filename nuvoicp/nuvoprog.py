@@ -0,0 +1,185 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+
+# nuvoprog - Python bindings for libnuvoprog, the nuvoicp programming engine
+# build the library with 'make lib' (or 'make NO_GPIOD=1 lib')
+#
+# Copyright (c) 2021 Steve Markgraf <steve@steve-m.de>
+#
+# Permission is hereby granted, free of charge, to any person obtaining
+# a copy of this software and associated documentation files (the
+# "Software"), to deal in the Software without restriction, including
+# without limitation the rights to use, copy, modify, merge, publish,
+# distribute, sublicense, and/or sell copies of the Software, and to
+# permit persons to whom the Software is furnished to do so, subject to
+# the following conditions:
+#
+# The above copyright notice and this permission notice shall be included
+# in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+# EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+# MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+# IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+# CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+# TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+# SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+
+import os
+import json
+import ctypes
+
+NVP_APROM		= 0
+NVP_LDROM		= 1
+NVP_CONFIG		= 2
+
+CFG_FLASH_ADDR		= 0x30000
+CFG_FLASH_LEN		= 5
+
+# $NUVOPROG_LIB, or the library built next to this file
+LIB_PATH = os.environ.get('NUVOPROG_LIB',
+	os.path.join(os.path.dirname(os.path.abspath(__file__)), 'libnuvoprog.so'))
+
+class NuvoprogError(OSError):
+	pass
+
+class Segment(ctypes.Structure):
+	_fields_ = [('region', ctypes.c_int),
+		    ('data', ctypes.c_char_p),
+		    ('len', ctypes.c_uint32)]
+
+PROGRESS_CB = ctypes.CFUNCTYPE(None, ctypes.c_void_p, ctypes.c_char_p,
+			       ctypes.c_uint32, ctypes.c_uint32)
+
+_lib = None
+
+def lib():
+	global _lib
+
+	if _lib:
+		return _lib
+
+	l = ctypes.CDLL(LIB_PATH)
+	sess = ctypes.c_void_p
+	err = ctypes.POINTER(ctypes.c_int)
+
+	l.nvp_open_icp.argtypes = [ctypes.c_char_p, err]
+	l.nvp_open_icp.restype = sess
+	l.nvp_open_isp.argtypes = [ctypes.c_char_p, ctypes.c_int, ctypes.c_int, err]
+	l.nvp_open_isp.restype = sess
+	l.nvp_close.argtypes = [sess]
+	l.nvp_close.restype = None
+	l.nvp_set_progress.argtypes = [sess, PROGRESS_CB, ctypes.c_void_p]
+	l.nvp_set_progress.restype = None
+	l.nvp_device_id.argtypes = [sess]
+	l.nvp_device_id.restype = ctypes.c_uint16
+	l.nvp_device_name.argtypes = [sess]
+	l.nvp_device_name.restype = ctypes.c_char_p
+	l.nvp_read_config.argtypes = [sess, ctypes.c_char_p]
+	l.nvp_program.argtypes = [sess, ctypes.POINTER(Segment), ctypes.c_int]
+	l.nvp_read_flash.argtypes = [sess, ctypes.c_uint32, ctypes.c_uint32, ctypes.c_char_p]
+	l.nvp_run.argtypes = [sess]
+	l.nvp_status.argtypes = [sess]
+	l.nvp_status.restype = ctypes.c_char_p
+	# keep the pointer, it has to go back to nvp_free()
+	l.nvp_stats_json.argtypes = [sess]
+	l.nvp_stats_json.restype = ctypes.c_void_p
+	l.nvp_free.argtypes = [ctypes.c_void_p]
+	l.nvp_free.restype = None
+
+	_lib = l
+	return l
+
+def check(ret, what):
+	if ret < 0:
+		raise NuvoprogError(-ret, '%s: %s' % (what, os.strerror(-ret)))
+	return ret
+
+class Session:
+	"""One connection to one target, see libnuvoprog.h"""
+
+	def __init__(self, handle):
+		self.handle = handle
+		self.progress_cb = None
+
+	@classmethod
+	def icp(cls, backend=None):
+		err = ctypes.c_int(0)
+		h = lib().nvp_open_icp(backend.encode() if backend else None, ctypes.byref(err))
+		if not h:
+			check(err.value, 'ICP connect')
+		return cls(h)
+
+	@classmethod
+	def isp(cls, port, baud=115200, connect_timeout=0):
+		err = ctypes.c_int(0)
+		h = lib().nvp_open_isp(port.encode(), baud, int(connect_timeout * 1000),
+				       ctypes.byref(err))
+		if not h:
+			check(err.value, 'ISP connect')
+		return cls(h)
+
+	def close(self):
+		if self.handle:
+			lib().nvp_close(self.handle)
+			self.handle = None
+
+	def __enter__(self):
+		return self
+
+	def __exit__(self, *exc):
+		self.close()
+
+	def __del__(self):
+		self.close()
+
+	def set_progress(self, fn):
+		"""fn(phase, done, total), None to disable"""
+		if fn:
+			self.progress_cb = PROGRESS_CB(lambda arg, phase, done, total:
+						       fn(phase.decode(), done, total))
+		else:
+			self.progress_cb = PROGRESS_CB()
+		lib().nvp_set_progress(self.handle, self.progress_cb, None)
+
+	@property
+	def device_id(self):
+		return lib().nvp_device_id(self.handle)
+
+	@property
+	def device_name(self):
+		return lib().nvp_device_name(self.handle).decode()
+
+	@property
+	def status(self):
+		return lib().nvp_status(self.handle).decode()
+
+	def read_config(self):
+		buf = ctypes.create_string_buffer(CFG_FLASH_LEN)
+		check(lib().nvp_read_config(self.handle, buf), 'read CONFIG')
+		return buf.raw
+
+	def program(self, aprom=None, ldrom=None, config=None):
+		segs = [(r, bytes(d)) for r, d in
+			((NVP_APROM, aprom), (NVP_LDROM, ldrom), (NVP_CONFIG, config))
+			if d is not None]
+		arr = (Segment * len(segs))(*[Segment(r, d, len(d)) for r, d in segs])
+		check(lib().nvp_program(self.handle, arr, len(segs)), 'program')
+
+	def read_flash(self, addr, length):
+		buf = ctypes.create_string_buffer(length)
+		check(lib().nvp_read_flash(self.handle, addr, length, buf), 'read flash')
+		return buf.raw
+
+	def run(self):
+		check(lib().nvp_run(self.handle), 'run')
+
+	def stats(self):
+		p = lib().nvp_stats_json(self.handle)
+		if not p:
+			raise NuvoprogError(12, 'stats: out of memory')
+		try:
+			return json.loads(ctypes.string_at(p).decode())
+		finally:
+			lib().nvp_free(p)
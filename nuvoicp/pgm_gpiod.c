@@ -0,0 +1,140 @@
+/*
+ * nuvoicp, a RPi ICP flasher for the Nuvoton N76E003
+ * https://github.com/steve-m/N76E003-playground
+ *
+ * Copyright (c) 2021 Steve Markgraf <steve@steve-m.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <gpiod.h>
+#include <errno.h>
+
+#include "nuvoicp.h"
+
+/* GPIO line numbers for RPi, must be changed for other SBCs */
+#define GPIO_DAT	20
+#define GPIO_RST	21
+#define GPIO_CLK	26
+
+#define CONSUMER "nuvoicp"
+struct gpiod_chip *chip;
+struct gpiod_line *dat_line, *rst_line, *clk_line;
+
+static int gpiod_init(void)
+{
+	int ret;
+
+	chip = gpiod_chip_open_by_name("gpiochip0");
+	if (!chip) {
+		fprintf(stderr, "Open chip failed\n");
+		return -ENOENT;
+	}
+
+	dat_line = gpiod_chip_get_line(chip, GPIO_DAT);
+	rst_line = gpiod_chip_get_line(chip, GPIO_RST);
+	clk_line = gpiod_chip_get_line(chip, GPIO_CLK);
+	if (!dat_line || !clk_line || !rst_line) {
+		fprintf(stderr, "Error getting required GPIO lines!\n");
+		return -ENOENT;
+	}
+
+	ret = gpiod_line_request_input(dat_line, CONSUMER);
+	ret |= gpiod_line_request_output(rst_line, CONSUMER, 0);
+	ret |= gpiod_line_request_output(clk_line, CONSUMER, 0);
+	pgm_cnt.ioctls += 6;
+	if (ret < 0) {
+		fprintf(stderr, "Request line as output failed\n");
+		return -ENOENT;
+	}
+
+	return 0;
+}
+
+static void gpiod_set_dat(int val)
+{
+	if (gpiod_line_set_value(dat_line, val) < 0)
+		fprintf(stderr, "Setting data line failed\n");
+	pgm_cnt.ioctls++;
+}
+
+static int gpiod_get_dat(void)
+{
+	int ret = gpiod_line_get_value(dat_line);
+	if (ret < 0)
+		fprintf(stderr, "Getting data line failed\n");
+	pgm_cnt.ioctls++;
+	return ret;
+}
+
+static void gpiod_set_rst(int val)
+{
+	if (gpiod_line_set_value(rst_line, val) < 0)
+		fprintf(stderr, "Setting reset line failed\n");
+	pgm_cnt.ioctls++;
+}
+
+static void gpiod_set_clk(int val)
+{
+	if (gpiod_line_set_value(clk_line, val) < 0)
+		fprintf(stderr, "Setting clock line failed\n");
+	pgm_cnt.ioctls++;
+}
+
+static void gpiod_dat_dir(int state)
+{
+	gpiod_line_release(dat_line);
+
+	int ret;
+	if (state)
+		ret = gpiod_line_request_output(dat_line, CONSUMER, 0);
+	else
+		ret = gpiod_line_request_input(dat_line, CONSUMER);
+
+	if (ret < 0)
+		fprintf(stderr, "Setting data directions failed\n");
+
+	/* the release and the new request */
+	pgm_cnt.ioctls += 2;
+}
+
+static void gpiod_deinit(void)
+{
+	gpiod_chip_close(chip);
+}
+
+static void gpiod_delay(uint32_t us)
+{
+	usleep(us);
+}
+
+const struct pgm_backend pgm_gpiod_backend = {
+	.name		= "gpiod",
+	.init		= gpiod_init,
+	.deinit		= gpiod_deinit,
+	.set_dat	= gpiod_set_dat,
+	.get_dat	= gpiod_get_dat,
+	.set_rst	= gpiod_set_rst,
+	.set_clk	= gpiod_set_clk,
+	.dat_dir	= gpiod_dat_dir,
+	.delay		= gpiod_delay,
+};
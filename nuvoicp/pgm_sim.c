@@ -0,0 +1,594 @@
+/*
+ * nuvoicp, a RPi ICP flasher for the Nuvoton N76E003
+ * https://github.com/steve-m/N76E003-playground
+ *
+ * Copyright (c) 2021 Steve Markgraf <steve@steve-m.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Simulated N76E003 ICP target with a virtual clock. Every pin operation
+ * and delay advances the clock according to a cost model of a real
+ * backend, so a simulated run reports the wall time it would take on
+ * hardware without actually sleeping. Any part of the device table can
+ * be simulated, see sim_set_device().
+ *
+ * The flash behaves like NOR flash: programming can only clear bits, only
+ * an erase sets them again, 0xff for a page or all of APROM, LDROM and
+ * CONFIG for a mass erase. Programming a byte that was not erased since it
+ * was last programmed is counted as a violation, even if the result would
+ * read back right, and so is an APROM write that runs into the LDROM that
+ * CONFIG sets up at that time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nuvoicp.h"
+
+#define SIM_CID		0xda
+#define SIM_UID		0x1a2b3c
+#define SIM_UCID	0x55aa1234
+
+#define ICP_ENTRY_RST_SEQ	0x9e1cb6
+#define ICP_ENTRY_SEQ		0x5aa503
+#define ICP_EXIT_SEQ		0x0f78f0
+
+#define SIM_MAX_FAIL_PAGES	8
+
+struct sim_cost_model {
+	const char *name;
+	uint32_t ioctl_ns;	/* per ioctl issued */
+	uint32_t reg_ns;	/* per GPIO register access */
+	uint32_t sleep_ns;	/* overshoot of every requested delay */
+	uint32_t op_ioctls;	/* per line set/get */
+	uint32_t op_regs;
+	uint32_t dir_ioctls;	/* per DAT direction switch */
+	uint32_t dir_regs;
+};
+
+/* rough figures for a Raspberry Pi 3/4 running a stock kernel */
+static const struct sim_cost_model cost_models[] = {
+	{ "gpiod",   2000,  0, 70000, 1, 0, 2, 0 },
+	{ "gpiomem",    0, 40, 70000, 0, 1, 0, 2 },
+	{ "ideal",      0,  0,     0, 0, 0, 0, 0 },
+};
+
+static struct sim_cost_model cost = cost_models[0];
+
+enum sim_phase {
+	SIM_RUNNING,	/* target not in ICP mode */
+	SIM_ENTRY,	/* RST entry sequence seen, waiting for entry word */
+	SIM_CMD,
+	SIM_READ,
+	SIM_READ_END,
+	SIM_WRITE,
+};
+
+/* injectable target faults, see sim_set_faults() */
+static struct {
+	double flip;		/* probability of a flipped DAT read */
+	double drop;		/* probability of a missed rising CLK edge */
+	int locked;
+	int pull_after;		/* bytes programmed before the board is pulled */
+	int num_fail_pages;
+	struct {
+		uint32_t addr;
+		int remaining;	/* program passes that will still fail */
+		int failed;	/* failed since the last erase */
+	} fail_pages[SIM_MAX_FAIL_PAGES];
+	uint64_t seed;
+} fault = { .pull_after = -1, .seed = 1 };
+
+static struct {
+	uint32_t flips;
+	uint32_t drops;
+	uint32_t failed_writes;
+	uint32_t written;
+	int pulled;
+} injected;
+
+/* broken flash rules since the programmer connected */
+static struct {
+	uint32_t unerased;	/* bytes programmed over not erased ones */
+	uint32_t unerased_addr;	/* the first of them */
+	uint32_t ldrom_spills;	/* bytes of an APROM write in LDROM */
+} violated;
+
+static struct {
+	uint64_t clock;
+	enum sim_phase phase;
+	uint32_t rst_seq;
+	uint32_t shift;
+	int nbits;
+	int clk, dat, dat_oe;
+	int dat_out;		/* level driven by the target, -1 if none */
+	uint8_t cmd;
+	uint32_t addr;
+	uint32_t write_start;	/* address of the current CMD_WRITE_FLASH */
+	uint8_t byte;
+	uint8_t flash[FLASH_MAX_SIZE];
+	uint8_t config[CFG_FLASH_LEN];
+} sim;
+
+static const struct nuvo_device *sim_dev = &devices[0];
+
+int sim_set_device(const char *name)
+{
+	const struct nuvo_device *d = device_find_name(name);
+
+	if (!d) {
+		fprintf(stderr, "Unknown part: %s\n", name);
+		return -1;
+	}
+
+	sim_dev = d;
+	return 0;
+}
+
+int sim_set_cost_model(const char *spec)
+{
+	char *s = strdup(spec);
+	char *tok, *save = NULL;
+	int ret = 0;
+
+	for (tok = strtok_r(s, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		char *val = strchr(tok, '=');
+
+		if (!val) {
+			size_t i;
+
+			for (i = 0; i < sizeof(cost_models) / sizeof(cost_models[0]); i++) {
+				if (!strcmp(tok, cost_models[i].name)) {
+					cost = cost_models[i];
+					break;
+				}
+			}
+
+			if (i == sizeof(cost_models) / sizeof(cost_models[0])) {
+				fprintf(stderr, "Unknown cost model: %s\n", tok);
+				ret = -1;
+			}
+			continue;
+		}
+
+		*val++ = '\0';
+		uint32_t v = strtoul(val, NULL, 0);
+
+		if (!strcmp(tok, "ioctl_ns"))
+			cost.ioctl_ns = v;
+		else if (!strcmp(tok, "reg_ns"))
+			cost.reg_ns = v;
+		else if (!strcmp(tok, "sleep_ns"))
+			cost.sleep_ns = v;
+		else if (!strcmp(tok, "op_ioctls"))
+			cost.op_ioctls = v;
+		else if (!strcmp(tok, "op_regs"))
+			cost.op_regs = v;
+		else if (!strcmp(tok, "dir_ioctls"))
+			cost.dir_ioctls = v;
+		else if (!strcmp(tok, "dir_regs"))
+			cost.dir_regs = v;
+		else {
+			fprintf(stderr, "Unknown cost model parameter: %s\n", tok);
+			ret = -1;
+		}
+	}
+
+	free(s);
+	return ret;
+}
+
+int sim_set_faults(const char *spec)
+{
+	char *s = strdup(spec);
+	char *tok, *save = NULL;
+	int ret = 0;
+
+	for (tok = strtok_r(s, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		char *val = strchr(tok, '=');
+
+		if (val)
+			*val++ = '\0';
+
+		if (!strcmp(tok, "locked"))
+			fault.locked = 1;
+		else if (!val) {
+			fprintf(stderr, "Missing value for fault: %s\n", tok);
+			ret = -1;
+		} else if (!strcmp(tok, "flip"))
+			fault.flip = strtod(val, NULL);
+		else if (!strcmp(tok, "drop"))
+			fault.drop = strtod(val, NULL);
+		else if (!strcmp(tok, "pull"))
+			fault.pull_after = strtol(val, NULL, 0);
+		else if (!strcmp(tok, "seed"))
+			fault.seed = strtoull(val, NULL, 0) ? : 1;
+		else if (!strcmp(tok, "page") && fault.num_fail_pages < SIM_MAX_FAIL_PAGES) {
+			char *count = strchr(val, ':');
+			int i = fault.num_fail_pages++;
+
+			fault.fail_pages[i].addr = strtoul(val, NULL, 0) & ~(PAGE_SIZE - 1);
+			fault.fail_pages[i].remaining = count ? atoi(count + 1) : 1;
+		} else {
+			fprintf(stderr, "Unknown fault: %s\n", tok);
+			ret = -1;
+		}
+	}
+
+	free(s);
+	return ret;
+}
+
+/* xorshift64, reproducible for a given seed */
+static int sim_chance(double p)
+{
+	if (p <= 0)
+		return 0;
+
+	fault.seed ^= fault.seed << 13;
+	fault.seed ^= fault.seed >> 7;
+	fault.seed ^= fault.seed << 17;
+
+	return (fault.seed >> 11) * (1.0 / 9007199254740992.0) < p;
+}
+
+static int sim_locked(void)
+{
+	return !(sim.config[0] & 0x02);
+}
+
+/* a page that fails to program recovers one pass per erase */
+static void sim_erase_fault(uint32_t addr, uint32_t len)
+{
+	for (int i = 0; i < fault.num_fail_pages; i++) {
+		if (fault.fail_pages[i].addr >= addr &&
+		    fault.fail_pages[i].addr < addr + len &&
+		    fault.fail_pages[i].failed) {
+			fault.fail_pages[i].failed = 0;
+			fault.fail_pages[i].remaining--;
+		}
+	}
+}
+
+static int sim_write_fault(uint32_t addr)
+{
+	if (fault.pull_after >= 0 && injected.written >= fault.pull_after) {
+		injected.pulled = 1;
+		return 1;
+	}
+	injected.written++;
+
+	for (int i = 0; i < fault.num_fail_pages; i++) {
+		if (fault.fail_pages[i].addr == (addr & ~(PAGE_SIZE - 1)) &&
+		    fault.fail_pages[i].remaining > 0) {
+			fault.fail_pages[i].failed = 1;
+			injected.failed_writes++;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* the LDROM size in CONFIG1 moves the end of APROM */
+static uint32_t sim_aprom_size(void)
+{
+	return sim_dev->flash_size - device_ldrom_size(sim_dev, sim.config);
+}
+
+/* NOR flash: the cells that are programmed go from 1 to 0, and stay there */
+static void sim_program(uint8_t *cell, uint32_t addr, uint8_t data)
+{
+	if (*cell != 0xff && data != 0xff && !violated.unerased++)
+		violated.unerased_addr = addr;
+
+	*cell &= data;
+}
+
+static void sim_op(uint32_t ioctls, uint32_t regs)
+{
+	sim.clock += ioctls * cost.ioctl_ns + regs * cost.reg_ns;
+	pgm_cnt.ioctls += ioctls;
+}
+
+static void sim_drive(int val)
+{
+	if (val == sim.dat_out)
+		return;
+
+	sim.dat_out = val;
+	trace(TRACE_TGT_DAT, val < 0 ? TRACE_Z : val);
+}
+
+static uint8_t sim_read_value(uint8_t cmd, uint32_t addr)
+{
+	switch (cmd) {
+	case CMD_READ_FLASH:
+		if (addr < sim_dev->flash_size)
+			return sim_locked() ? 0xff : sim.flash[addr];
+		if (addr >= CFG_FLASH_ADDR && addr < CFG_FLASH_ADDR + sim_dev->cfg_len)
+			return sim.config[addr - CFG_FLASH_ADDR];
+		return 0xff;
+	case CMD_READ_UID:
+		if (addr < 3)
+			return SIM_UID >> (addr * 8);
+		if (addr >= 0x20 && addr < 0x24)
+			return SIM_UCID >> ((addr - 0x20) * 8);
+		return 0xff;
+	case CMD_READ_CID:
+		return sim_locked() ? 0xff : SIM_CID;
+	case CMD_READ_DEVICE_ID:
+		return sim_dev->devid >> ((addr & 1) * 8);
+	default:
+		return 0xff;
+	}
+}
+
+static void sim_write_value(uint8_t cmd, uint32_t addr, uint8_t data)
+{
+	switch (cmd) {
+	case CMD_WRITE_FLASH:
+		if (sim_write_fault(addr))
+			break;
+		if (addr < sim_dev->flash_size) {
+			if (sim.write_start < sim_aprom_size() && addr >= sim_aprom_size())
+				violated.ldrom_spills++;
+			sim_program(&sim.flash[addr], addr, data);
+		} else if (addr >= CFG_FLASH_ADDR && addr < CFG_FLASH_ADDR + sim_dev->cfg_len)
+			sim_program(&sim.config[addr - CFG_FLASH_ADDR], addr, data);
+		break;
+	case CMD_MASS_ERASE:
+		memset(sim.flash, 0xff, sizeof(sim.flash));
+		memset(sim.config, 0xff, sizeof(sim.config));
+		sim_erase_fault(0, sim_dev->flash_size);
+		break;
+	case CMD_PAGE_ERASE:
+		addr &= ~(sim_dev->page_size - 1);
+		sim_erase_fault(addr, sim_dev->page_size);
+		if (addr < sim_dev->flash_size)
+			memset(&sim.flash[addr], 0xff, sim_dev->page_size);
+		else if (addr >= CFG_FLASH_ADDR && addr < CFG_FLASH_ADDR + sim_dev->page_size)
+			memset(sim.config, 0xff, sizeof(sim.config));
+		break;
+	}
+}
+
+static void sim_command(uint32_t word)
+{
+	sim.cmd = word & 0x3f;
+	sim.addr = (word >> 6) & 0x3ffff;
+	sim.nbits = 0;
+
+	if (word == ICP_EXIT_SEQ) {
+		sim.phase = SIM_RUNNING;
+		return;
+	}
+
+	switch (sim.cmd) {
+	case CMD_READ_FLASH:
+	case CMD_READ_UID:
+	case CMD_READ_CID:
+	case CMD_READ_DEVICE_ID:
+		sim.phase = SIM_READ;
+		sim.byte = sim_read_value(sim.cmd, sim.addr);
+		break;
+	case CMD_WRITE_FLASH:
+	case CMD_MASS_ERASE:
+	case CMD_PAGE_ERASE:
+		sim.phase = SIM_WRITE;
+		sim.write_start = sim.addr;
+		break;
+	default:
+		sim.phase = SIM_CMD;
+		break;
+	}
+}
+
+/* the target samples DAT and advances its state on rising CLK edges */
+static void sim_clk_rising(void)
+{
+	int dat = sim.dat_oe ? sim.dat : 0;
+
+	switch (sim.phase) {
+	case SIM_RUNNING:
+		break;
+	case SIM_ENTRY:
+	case SIM_CMD:
+		sim.shift = (sim.shift << 1) | dat;
+		if (++sim.nbits < 24)
+			break;
+
+		sim.shift &= 0xffffff;
+		if (sim.phase == SIM_ENTRY) {
+			sim.phase = sim.shift == ICP_ENTRY_SEQ ? SIM_CMD : SIM_RUNNING;
+			sim.nbits = 0;
+		} else
+			sim_command(sim.shift);
+		break;
+	case SIM_READ:
+		if (++sim.nbits == 8)
+			sim.phase = SIM_READ_END;
+		break;
+	case SIM_READ_END:
+		sim.nbits = 0;
+		if (dat) {
+			sim.phase = SIM_CMD;
+			break;
+		}
+		sim.phase = SIM_READ;
+		sim.byte = sim_read_value(sim.cmd, ++sim.addr);
+		break;
+	case SIM_WRITE:
+		if (sim.nbits < 8) {
+			sim.byte = (sim.byte << 1) | dat;
+			sim.nbits++;
+			break;
+		}
+
+		/* 9th clock: end bit, the target executes the command */
+		sim_write_value(sim.cmd, sim.addr, sim.byte);
+		sim.nbits = 0;
+		if (dat)
+			sim.phase = SIM_CMD;
+		else
+			sim.addr++;
+		break;
+	}
+
+	sim_drive(sim.phase == SIM_READ ? (sim.byte >> (7 - sim.nbits)) & 1 : -1);
+}
+
+static int sim_init(void)
+{
+	static int powered;
+
+	/* flash keeps its content when the programmer reconnects */
+	if (!powered) {
+		memset(sim.flash, 0xff, sizeof(sim.flash));
+		memset(sim.config, 0xff, sizeof(sim.config));
+		powered = 1;
+
+		/* a locked chip has the LOCK bit in CONFIG0 cleared, until a mass erase */
+		if (fault.locked)
+			sim.config[0] &= ~0x02;
+	}
+
+	sim.phase = SIM_RUNNING;
+	sim.dat_out = -1;
+	memset(&violated, 0, sizeof(violated));
+
+	return 0;
+}
+
+static void sim_deinit(void)
+{
+	fprintf(stderr, "Simulated target: projected wall time %.3f s with '%s' "
+		"cost model (ioctl %u ns, register %u ns, sleep overshoot %u ns)\n",
+		sim.clock / 1e9, cost.name, cost.ioctl_ns, cost.reg_ns, cost.sleep_ns);
+
+	if (injected.flips || injected.drops || injected.failed_writes || injected.pulled)
+		fprintf(stderr, "Injected faults: %u DAT bit flips, %u dropped CLK "
+			"edges, %u failed byte writes%s\n", injected.flips,
+			injected.drops, injected.failed_writes,
+			injected.pulled ? ", board pulled" : "");
+
+	uint32_t ldrom = device_ldrom_size(sim_dev, sim.config);
+	int ldrom_boot = ldrom && !(sim.config[0] & 0x80);
+	uint32_t used = 0;
+
+	for (uint32_t i = sim_aprom_size(); i < sim_dev->flash_size; i++)
+		used += sim.flash[i] != 0xff;
+
+	fprintf(stderr, "Simulated flash: %u bytes APROM, %u bytes LDROM, boots from %s%s\n",
+		sim_aprom_size(), ldrom, ldrom_boot ? "LDROM" : "APROM",
+		ldrom_boot && !used ? ", which is empty" : "");
+
+	if (violated.unerased)
+		fprintf(stderr, "Flash rule violated: %u bytes programmed without an erase, "
+			"the first at 0x%05x\n", violated.unerased, violated.unerased_addr);
+	if (violated.ldrom_spills)
+		fprintf(stderr, "Flash rule violated: %u bytes of APROM writes in LDROM\n",
+			violated.ldrom_spills);
+}
+
+static uint32_t sim_violations(void)
+{
+	return violated.unerased + violated.ldrom_spills;
+}
+
+static void sim_set_dat(int val)
+{
+	sim_op(cost.op_ioctls, cost.op_regs);
+	sim.dat = val;
+}
+
+static int sim_get_dat(void)
+{
+	sim_op(cost.op_ioctls, cost.op_regs);
+
+	int val = sim.dat_out < 0 || injected.pulled ? 0 : sim.dat_out;
+
+	if (sim_chance(fault.flip)) {
+		injected.flips++;
+		val ^= 1;
+	}
+
+	return val;
+}
+
+static void sim_set_rst(int val)
+{
+	sim_op(cost.op_ioctls, cost.op_regs);
+
+	/* the target samples RST once per bit period of the entry sequence */
+	sim.rst_seq = (sim.rst_seq << 1) | val;
+	if ((sim.rst_seq & 0xffffff) == ICP_ENTRY_RST_SEQ) {
+		sim.phase = SIM_ENTRY;
+		sim.shift = 0;
+		sim.nbits = 0;
+	}
+}
+
+static void sim_set_clk(int val)
+{
+	sim_op(cost.op_ioctls, cost.op_regs);
+
+	if (val && !sim.clk && !injected.pulled) {
+		if (sim_chance(fault.drop))
+			injected.drops++;
+		else
+			sim_clk_rising();
+	}
+	sim.clk = val;
+}
+
+static void sim_dat_dir(int state)
+{
+	sim_op(cost.dir_ioctls, cost.dir_regs);
+	sim.dat_oe = state;
+	sim.dat = 0;
+}
+
+static void sim_delay(uint32_t us)
+{
+	sim.clock += (uint64_t)us * 1000 + cost.sleep_ns;
+}
+
+static uint64_t sim_clock_ns(void)
+{
+	return sim.clock;
+}
+
+const struct pgm_backend pgm_sim_backend = {
+	.name		= "sim",
+	.init		= sim_init,
+	.deinit		= sim_deinit,
+	.set_dat	= sim_set_dat,
+	.get_dat	= sim_get_dat,
+	.set_rst	= sim_set_rst,
+	.set_clk	= sim_set_clk,
+	.dat_dir	= sim_dat_dir,
+	.delay		= sim_delay,
+	.clock_ns	= sim_clock_ns,
+	.violations	= sim_violations,
+};
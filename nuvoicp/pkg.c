@@ -0,0 +1,139 @@
+/*
+ * nuvoicp, a RPi ICP flasher for the Nuvoton N76E003
+ * https://github.com/steve-m/N76E003-playground
+ *
+ * Copyright (c) 2021 Steve Markgraf <steve@steve-m.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Firmware packages, see nuvoispy/nuvopkg.py for the layout. A package
+ * is mapped read-only and shared with every other process using it; only
+ * the header and segment table are looked at, the CRCs were computed when
+ * the package was built.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "nuvoicp.h"
+
+/* -EINVAL if the file is not a package, so callers can fall back to raw images */
+int pkg_open(struct pkg *pkg, const char *filename)
+{
+	struct stat st;
+	int fd = open(filename, O_RDONLY);
+
+	memset(pkg, 0, sizeof(*pkg));
+
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(struct pkg_header)) {
+		close(fd);
+		return -EINVAL;
+	}
+
+	pkg->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (pkg->map == MAP_FAILED) {
+		pkg->map = NULL;
+		return -errno;
+	}
+
+	pkg->size = st.st_size;
+	pkg->hdr = (const struct pkg_header *)pkg->map;
+	pkg->segs = (const struct pkg_segment *)(pkg->map + sizeof(struct pkg_header));
+
+	if (memcmp(pkg->hdr->magic, PKG_MAGIC, sizeof(pkg->hdr->magic)) ||
+	    pkg->hdr->version != PKG_VERSION || !pkg->hdr->page_size ||
+	    sizeof(struct pkg_header) + pkg->hdr->num_segments * sizeof(struct pkg_segment) > pkg->size)
+		goto invalid;
+
+	for (int i = 0; i < pkg->hdr->num_segments; i++) {
+		const struct pkg_segment *s = &pkg->segs[i];
+		uint64_t pages = (s->len + pkg->hdr->page_size - 1) / pkg->hdr->page_size;
+
+		if ((uint64_t)s->data_offset + s->len > pkg->size ||
+		    (uint64_t)s->hash_offset + pages * 4 > pkg->size)
+			goto invalid;
+	}
+
+	return 0;
+
+invalid:
+	pkg_close(pkg);
+	return -EINVAL;
+}
+
+void pkg_close(struct pkg *pkg)
+{
+	if (pkg->map)
+		munmap((void *)pkg->map, pkg->size);
+
+	memset(pkg, 0, sizeof(*pkg));
+}
+
+const struct pkg_segment *pkg_find(const struct pkg *pkg, uint32_t region)
+{
+	for (int i = 0; i < pkg->hdr->num_segments; i++) {
+		if (pkg->segs[i].region == region)
+			return &pkg->segs[i];
+	}
+
+	return NULL;
+}
+
+/* the plan of the images in the package */
+int plan_load_pkg(struct flash_plan *p, const struct pkg *pkg)
+{
+	const struct pkg_segment *aprom = pkg_find(pkg, PKG_APROM);
+	const struct pkg_segment *ldrom = pkg_find(pkg, PKG_LDROM);
+	const struct pkg_segment *cfg = pkg_find(pkg, PKG_CONFIG);
+
+	if ((ldrom && ldrom->len > LDROM_MAX_SIZE) || (cfg && cfg->len > CFG_FLASH_LEN) ||
+	    (aprom && aprom->len > FLASH_MAX_SIZE))
+		return -EFBIG;
+
+	plan_init(p);
+	p->devid = pkg->hdr->devid;
+
+	if (ldrom && ldrom->len)
+		plan_set_ldrom(p, pkg->map + ldrom->data_offset, ldrom->len);
+
+	if (aprom) {
+		plan_set_aprom(p, pkg->map + aprom->data_offset, aprom->len);
+		p->aprom_crc = aprom->crc;
+		p->aprom_crc_valid = 1;
+	}
+
+	if (cfg)
+		plan_set_config(p, pkg->map + cfg->data_offset, cfg->len);
+
+	return 0;
+}
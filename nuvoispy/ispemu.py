@@ -0,0 +1,529 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+
+# ispemu - emulator of the N76E003 UART ISP bootloader behind a pseudo-terminal
+# for testing and benchmarking nuvoispy without an adapter or a board
+#
+# Copyright (c) 2019-2020 Steve Markgraf <steve@steve-m.de>
+#
+# Permission is hereby granted, free of charge, to any person obtaining
+# a copy of this software and associated documentation files (the
+# "Software"), to deal in the Software without restriction, including
+# without limitation the rights to use, copy, modify, merge, publish,
+# distribute, sublicense, and/or sell copies of the Software, and to
+# permit persons to whom the Software is furnished to do so, subject to
+# the following conditions:
+#
+# The above copyright notice and this permission notice shall be included
+# in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+# EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+# MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+# IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+# CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+# TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+# SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+
+import sys
+import os
+import pty
+import tty
+import time
+import json
+import select
+import signal
+import argparse
+import threading
+import zlib
+import random
+
+from nuvoispy import *
+
+FW_VERSION		= 0x27
+NUVOBOOT_FW_VERSION	= 0x81
+STREAM_WINDOW		= 3
+CRC_US			= 4.0		# IAP byte read and CRC update per byte
+READ_US			= 2.0		# IAP byte read
+WEAK_CHANCE		= 0.05		# of a programming operation with --weak-bits
+FLASH_SIZE		= geometry(N76E003_DEVID)[0]
+
+emulators = []
+
+class IspEmulator:
+	"""Bootloader state and timing model of one emulated board"""
+
+	def __init__(self, args, index=0):
+		self.args = args
+		self.index = index
+		self.flash = bytearray(b'\xff' * FLASH_SIZE)
+		# boot from LDROM, 2 KB LDROM
+		self.config = bytearray([0x7f, 0xfd, 0xff, 0xff, 0xff])
+		self.connected = False
+		self.update = None
+		self.ran = False
+		self.baud = args.baud
+		self.new_baud = None
+		self.stream_seq = 0
+		self.dropping = False
+		self.weak_bits = args.weak_bits
+		# with --listen-ms the board runs its application until reset
+		self.listen_until = 0 if args.listen_ms else None
+		self.reset_at = None
+		self.stats = { "packets": 0, "bytes_programmed": 0, "pages_erased": 0,
+			       "stream_bytes": 0, "stream_raw_bytes": 0, "replies_lost": 0,
+			       "replies_corrupted": 0, "busy_s": 0.0, "first_packet": None, "last_reply": None }
+
+		if args.load:
+			with open(args.load, "rb") as f:
+				data = f.read(self.aprom_size())
+			self.flash[0:len(data)] = data
+
+		self.master, slave = pty.openpty()
+		tty.setraw(self.master)
+		tty.setraw(slave)
+		self.slave = slave
+		self.name = os.ttyname(slave)
+
+	def reset(self):
+		"""SIGUSR1, as if the adapter pulsed the reset line"""
+		self.connected = False
+		self.update = None
+		self.baud = self.args.baud
+		self.new_baud = None
+		self.stream_seq = 0
+		self.reset_at = time.monotonic()
+		if self.listen_until is not None:
+			self.listen_until = self.reset_at + self.args.listen_ms / 1000
+
+	def aprom_size(self):
+		return FLASH_SIZE - ldrom_size(self.config)
+
+	def in_aprom(self, start, length):
+		"""nuvoboot does not answer requests that reach past APROM"""
+		return not self.args.nuvoboot or \
+			(start <= self.aprom_size() and length <= self.aprom_size() - start)
+
+	def wire_time(self, nbytes):
+		# 8N1, 10 bits per byte
+		return nbytes * 10 / self.baud if self.baud else 0
+
+	def erase(self, start, length):
+		for page in range(start // PAGE_SIZE, (start + length + PAGE_SIZE - 1) // PAGE_SIZE):
+			self.flash[page * PAGE_SIZE:(page + 1) * PAGE_SIZE] = b'\xff' * PAGE_SIZE
+			self.stats["pages_erased"] += 1
+		return self.args.erase_ms / 1000 * ((length + PAGE_SIZE - 1) // PAGE_SIZE)
+
+	def write(self, start, data):
+		"""programming only clears bits, like IAP on NOR flash"""
+		for i, b in enumerate(data):
+			self.flash[start + i] &= b
+
+	def weaken(self, start, end):
+		"""with --weak-bits, sometimes leave one bit of a programmed byte at 1"""
+		if not self.weak_bits or random.random() >= WEAK_CHANCE:
+			return
+
+		addrs = [a for a in range(start, end) if self.flash[a] != 0xff]
+		if addrs:
+			a = random.choice(addrs)
+			zeroes = ~self.flash[a] & 0xff
+			self.flash[a] |= zeroes & -zeroes
+			self.weak_bits -= 1
+			print("%s: weak bit at 0x%04x" % (self.name, a), file=sys.stderr, flush=True)
+
+	def program(self, data):
+		u = self.update
+		n = min(len(data), u["end"] - u["addr"])
+		self.write(u["addr"], data[:n])
+		self.weaken(u["addr"], u["addr"] + n)
+		u["addr"] += n
+		self.stats["bytes_programmed"] += n
+		if u["addr"] >= u["end"]:
+			self.update = None
+		return self.args.prog_us / 1e6 * n
+
+	def handle(self, rx):
+		"""process one packet, returns (reply or None, busy time)"""
+		cmd = rx[0]
+		busy = 0.0
+		data = bytearray(PACKSIZE)
+
+		if not self.connected and self.listen_until is not None:
+			# nuvoboot listens until it has been idle for a while
+			if time.monotonic() > self.listen_until:
+				return None, 0
+			self.listen_until = time.monotonic() + self.args.listen_ms / 1000
+
+		if cmd == CMD_CONNECT:
+			if not self.connected and self.reset_at is not None:
+				print("%s: connected %.1f ms after reset" %
+				      (self.name, (time.monotonic() - self.reset_at) * 1000),
+				      file=sys.stderr, flush=True)
+			self.connected = True
+			self.update = None
+		elif not self.connected:
+			return None, 0
+		elif cmd == CMD_SYNC_PACKNO:
+			pass
+		elif cmd == CMD_GET_FWVER:
+			data[8] = NUVOBOOT_FW_VERSION if self.args.nuvoboot else FW_VERSION
+		elif cmd == CMD_GET_DEVICEID:
+			data[8] = N76E003_DEVID & 0xff
+			data[9] = N76E003_DEVID >> 8
+		elif cmd == CMD_READ_CONFIG:
+			data[8:8 + len(self.config)] = self.config
+			data[13:16] = b'\xff\xff\xff'
+		elif cmd == CMD_UPDATE_CONFIG:
+			self.config[:] = rx[8:8 + len(self.config)]
+			data[8:8 + len(self.config)] = self.config
+			busy += self.args.erase_ms / 1000 + self.args.prog_us / 1e6 * len(self.config)
+		elif cmd == CMD_UPDATE_APROM:
+			start = int.from_bytes(rx[8:12], "little")
+			length = int.from_bytes(rx[12:16], "little")
+			if not self.in_aprom(start, length):
+				return None, 0
+			length = min(length, self.aprom_size() - start)
+			busy += self.erase(start, length)
+			self.update = { "addr": start, "end": start + length }
+			busy += self.program(rx[16:64])
+		elif cmd == CMD_RUN_APROM:
+			# a software reset, the bootloader comes back at the default baud rate
+			self.connected = False
+			self.update = None
+			self.baud = self.args.baud
+			self.new_baud = None
+			self.stream_seq = 0
+			self.ran = True
+			if self.listen_until is not None:
+				self.listen_until = 0
+			self.report()
+			if self.args.exit_after_run and all(emu.ran for emu in emulators):
+				os.kill(os.getpid(), signal.SIGTERM)
+			return None, 0
+		elif cmd == 0:
+			# past the end of the update the data is dropped, but still acknowledged
+			if self.update:
+				busy += self.program(rx[8:64])
+		elif not self.args.nuvoboot:
+			return None, 0
+		elif cmd == CMD_GET_CAPS:
+			data[8] = 1
+			data[9] = PAGE_SIZE
+			data[10] = self.window()
+			data[11] = (1 << len(FAST_BAUDS)) - 1
+			data[12] = CAP_CRC32 | CAP_PAGES | CAP_LZ | CAP_READ
+		elif cmd == CMD_SET_BAUD:
+			rate = int.from_bytes(rx[8:12], "little")
+			data[8] = rate not in FAST_BAUDS
+			if rate in FAST_BAUDS:
+				self.new_baud = rate
+				data[9] = self.window(rate)
+		elif cmd == CMD_ERASE:
+			start = int.from_bytes(rx[8:12], "little")
+			length = int.from_bytes(rx[12:16], "little")
+			if not self.in_aprom(start, length):
+				return None, 0
+			busy += self.erase(start, length)
+			self.stream_seq = 0
+		elif cmd == CMD_CRC32:
+			start = int.from_bytes(rx[8:12], "little")
+			end = start + int.from_bytes(rx[12:16], "little")
+			if not self.in_aprom(start, end - start):
+				return None, 0
+			data[8:12] = zlib.crc32(self.flash[start:end]).to_bytes(4, "little")
+			busy += CRC_US / 1e6 * (end - start)
+		elif cmd == CMD_WRITE:
+			start = int.from_bytes(rx[8:12], "little")
+			n = min(rx[12], WRITE_LEN)
+			if not self.in_aprom(start, n):
+				return None, 0
+			self.write(start, rx[16:16 + n])
+			self.weaken(start, start + n)
+			self.stats["bytes_programmed"] += n
+			busy += self.args.prog_us / 1e6 * n
+		elif cmd == CMD_PAGE_CRCS:
+			n = min(rx[9], MAX_PAGE_CRCS)
+			if not self.in_aprom(rx[8] * PAGE_SIZE, n * PAGE_SIZE):
+				return None, 0
+			for i in range(n):
+				start = (rx[8] + i) * PAGE_SIZE
+				end = start + PAGE_SIZE
+				data[8 + i * 4:12 + i * 4] = zlib.crc32(self.flash[start:end]).to_bytes(4, "little")
+				busy += CRC_US / 1e6 * (end - start)
+		elif cmd == CMD_READ:
+			start = int.from_bytes(rx[8:12], "little")
+			n = min(rx[12], READ_LEN)
+			if not self.in_aprom(start, n):
+				return None, 0
+			chunk = self.flash[start:start + n]
+			data[8:8 + len(chunk)] = chunk
+			busy += READ_US / 1e6 * len(chunk)
+		else:
+			return None, 0
+
+		# checksum of the received packet and incremented packet number
+		chksum = sum(rx) & 0xffff
+		packno = (int.from_bytes(rx[4:8], "little") + 1) & 0xffffffff
+		data[0:2] = chksum.to_bytes(2, "little")
+		data[4:8] = packno.to_bytes(4, "little")
+
+		return bytes(data), busy
+
+	def window(self, baud=None):
+		# at 1 Mbaud the UART buffer does not outlast an IAP byte program
+		return 1 if (baud or self.baud) >= 1000000 else STREAM_WINDOW
+
+	def lz_page(self, addr, tokens):
+		"""decode like nuvoboot, straight into flash, None if malformed"""
+		pos = i = 0
+
+		def put(b):
+			# erased flash needs no programming for 0xff
+			if b != 0xff:
+				self.flash[addr + pos] &= b
+			return b != 0xff
+
+		programmed = 0
+		while i < len(tokens):
+			c = tokens[i]
+			i += 1
+			n = c + 1 if c < 0x80 else (c & 0x3f) + 3
+			if n > PAGE_SIZE - pos or (c < 0x80 and n > len(tokens) - i) or \
+			   (c >= 0x80 and i == len(tokens)):
+				return None
+
+			if c < 0x80:
+				for b in tokens[i:i + n]:
+					programmed += put(b)
+					pos += 1
+				i += n
+				continue
+
+			v = tokens[i]
+			i += 1
+			if c >= 0xc0 and (not v or v > pos):
+				return None
+
+			for _ in range(n):
+				programmed += put(v if c < 0xc0 else self.flash[addr + pos - v])
+				pos += 1
+
+		return programmed
+
+	def stream(self, rx):
+		"""one CMD_STREAM_DATA or CMD_STREAM_LZ frame, returns (ack, busy time)"""
+		addr = int.from_bytes(rx[2:4], "little")
+		busy = 0.0
+		self.stats["stream_bytes"] += len(rx)
+		self.stats["stream_raw_bytes"] += STREAM_FRAME_SIZE
+
+		if sum(rx[:-2]) & 0xffff != int.from_bytes(rx[-2:], "little"):
+			status = 1
+		elif rx[1] != self.stream_seq:
+			status = 2
+		elif addr % PAGE_SIZE or addr >= self.aprom_size():
+			status = 3
+		elif rx[0] == CMD_STREAM_LZ:
+			programmed = self.lz_page(addr, rx[LZ_HEADER_SIZE:-2])
+			status = STREAM_OK if programmed is not None else 4
+			if programmed is not None:
+				self.weaken(addr, addr + PAGE_SIZE)
+				self.stats["bytes_programmed"] += PAGE_SIZE
+				busy = self.args.prog_us / 1e6 * programmed
+				self.stream_seq = (self.stream_seq + 1) & 0xff
+		else:
+			status = STREAM_OK
+			self.write(addr, rx[4:4 + PAGE_SIZE])
+			self.weaken(addr, addr + PAGE_SIZE)
+			self.stats["bytes_programmed"] += PAGE_SIZE
+			busy = self.args.prog_us / 1e6 * PAGE_SIZE
+			self.stream_seq = (self.stream_seq + 1) & 0xff
+
+		# after an error everything is ignored until the next frame gap
+		self.dropping = status != STREAM_OK
+		seq = (self.stream_seq - 1) & 0xff
+
+		return bytes([CMD_STREAM_DATA, seq, status, CMD_STREAM_DATA ^ seq ^ status]), busy
+
+	def frame_size(self, buf):
+		"""length of the frame starting buf, None until that is known"""
+		if self.args.nuvoboot and self.connected and buf[0] == CMD_STREAM_DATA:
+			return STREAM_FRAME_SIZE
+		if self.args.nuvoboot and self.connected and buf[0] == CMD_STREAM_LZ:
+			if len(buf) < LZ_HEADER_SIZE:
+				return None
+			return LZ_HEADER_SIZE + min(buf[4], LZ_MAX_DATA) + 2
+		return PACKSIZE
+
+	def report(self):
+		s = self.stats
+		if s["first_packet"] is None or s["last_reply"] is None:
+			return
+
+		elapsed = s["last_reply"] - s["first_packet"]
+		result = { "port": self.name, "packets": s["packets"],
+			   "bytes_programmed": s["bytes_programmed"],
+			   "pages_erased": s["pages_erased"], "elapsed_s": round(elapsed, 4),
+			   "target_busy_s": round(s["busy_s"], 4), "replies_lost": s["replies_lost"],
+			   "replies_corrupted": s["replies_corrupted"],
+			   "bytes_per_s": round(s["bytes_programmed"] / elapsed, 1) if elapsed else 0 }
+
+		# effective gain of compressed stream frames over plain ones
+		if s["stream_bytes"]:
+			result["stream_gain"] = round(s["stream_raw_bytes"] / s["stream_bytes"], 2)
+
+		if self.args.json:
+			print(json.dumps(result), file=sys.stderr, flush=True)
+		else:
+			print("%s: %d packets, %d bytes programmed in %.3f s (%.1f bytes/s)" %
+			      (self.name, s["packets"], s["bytes_programmed"], elapsed,
+			       result["bytes_per_s"]), file=sys.stderr, flush=True)
+			if s["replies_lost"]:
+				print("%s: %d replies lost" % (self.name, s["replies_lost"]), file=sys.stderr, flush=True)
+			if s["replies_corrupted"]:
+				print("%s: %d replies corrupted" % (self.name, s["replies_corrupted"]),
+				      file=sys.stderr, flush=True)
+			if "stream_gain" in result:
+				print("%s: stream frames %d bytes on the wire instead of %d, %.2fx throughput" %
+				      (self.name, s["stream_bytes"], s["stream_raw_bytes"], result["stream_gain"]),
+				      file=sys.stderr, flush=True)
+
+		if self.args.save:
+			suffix = str(self.index) if self.args.count > 1 else ""
+			with open(self.args.save + suffix, "wb") as f:
+				f.write(self.flash[0:self.aprom_size()])
+
+		s["first_packet"] = None
+		s["packets"] = s["bytes_programmed"] = s["pages_erased"] = 0
+		s["stream_bytes"] = s["stream_raw_bytes"] = s["replies_lost"] = 0
+		s["replies_corrupted"] = 0
+		s["busy_s"] = 0.0
+
+	def run(self):
+		buf = b''
+		first = 0
+
+		while True:
+			r, _, _ = select.select([self.master], [], [], FRAME_GAP)
+			now = time.monotonic()
+
+			if not r:
+				# the bootloader resynchronizes its framing on idle
+				buf = b''
+				self.dropping = False
+				continue
+
+			try:
+				d = os.read(self.master, 4096)
+			except OSError:
+				time.sleep(FRAME_GAP)
+				continue
+
+			if self.dropping:
+				continue
+
+			if not buf:
+				first = now
+			buf += d
+
+			while buf and self.frame_size(buf) and len(buf) >= self.frame_size(buf) and not self.dropping:
+				size = self.frame_size(buf)
+				rx, buf = buf[:size], buf[size:]
+
+				# the last byte arrives one frame time after the first one
+				time.sleep(max(0, first + self.wire_time(size) - time.monotonic()))
+				first = time.monotonic()
+
+				if self.stats["first_packet"] is None:
+					self.stats["first_packet"] = first
+				self.stats["packets"] += 1
+
+				if self.args.nuvoboot and self.connected and rx[0] in (CMD_STREAM_DATA, CMD_STREAM_LZ):
+					reply, busy = self.stream(rx)
+				else:
+					reply, busy = self.handle(rx)
+
+				if reply is None:
+					continue
+
+				# the request was processed, only the reply gets lost
+				if random.random() * 100 < self.args.loss:
+					self.stats["replies_lost"] += 1
+					continue
+
+				# or it arrives with a bad checksum
+				if random.random() * 100 < self.args.corrupt:
+					self.stats["replies_corrupted"] += 1
+					reply = bytes([reply[0] ^ 0xff]) + reply[1:]
+
+				self.stats["busy_s"] += busy
+				time.sleep(busy + self.args.latency / 1000 + self.wire_time(len(reply)))
+				os.write(self.master, reply)
+				self.stats["last_reply"] = time.monotonic()
+
+				if self.new_baud:
+					self.baud = self.new_baud if self.baud else 0
+					self.new_baud = None
+
+			if self.dropping:
+				buf = b''
+
+def main():
+	parser = argparse.ArgumentParser(description="N76E003 UART ISP bootloader emulator on a pseudo-terminal")
+	parser.add_argument("-n", "--count", type=int, default=1, help="number of emulated boards (default: 1)")
+	parser.add_argument("-b", "--baud", type=int, default=115200,
+			    help="baud rate to pace the link at, 0 for unpaced (default: 115200)")
+	parser.add_argument("-L", "--latency", type=float, default=0.0,
+			    help="additional response latency in ms, e.g. a USB-serial latency timer")
+	parser.add_argument("--erase-ms", type=float, default=5.0, help="page erase time in ms (default: 5)")
+	parser.add_argument("--prog-us", type=float, default=25.0, help="byte program time in us (default: 25)")
+	parser.add_argument("--nuvoboot", action="store_true",
+			    help="emulate nuvoboot and its streaming and baud rate extensions")
+	parser.add_argument("--loss", type=float, default=0, metavar="PCT",
+			    help="drop this percentage of replies (default: 0)")
+	parser.add_argument("--corrupt", type=float, default=0, metavar="PCT",
+			    help="corrupt the checksum of this percentage of replies (default: 0)")
+	parser.add_argument("--weak-bits", type=int, default=0, metavar="N",
+			    help="let N randomly chosen programming operations leave a bit "
+			    "unprogrammed, to exercise verification (default: 0)")
+	parser.add_argument("--listen-ms", type=float, default=0, metavar="MS",
+			    help="only accept CMD_CONNECT within MS of a reset, which SIGUSR1 "
+			    "triggers on every board (default: always)")
+	parser.add_argument("--load", help="initial APROM content")
+	parser.add_argument("--save", help="write APROM content to this file after CMD_RUN_APROM, "
+			    "suffixed with the index if -n > 1")
+	parser.add_argument("--link", help="create a symlink to the pty, suffixed with the index if -n > 1")
+	parser.add_argument("--json", action="store_true", help="report throughput as JSON lines")
+	parser.add_argument("--exit-after-run", action="store_true",
+			    help="exit once every board has received CMD_RUN_APROM")
+	args = parser.parse_args()
+
+	emulators.extend(IspEmulator(args, i) for i in range(args.count))
+	links = []
+
+	for i, emu in enumerate(emulators):
+		if args.link:
+			link = args.link + (str(i) if args.count > 1 else "")
+			if os.path.lexists(link):
+				os.unlink(link)
+			os.symlink(emu.name, link)
+			links.append(link)
+		print(emu.name, flush=True)
+		threading.Thread(target=emu.run, daemon=True).start()
+
+	def cleanup(signum, frame):
+		for link in links:
+			os.unlink(link)
+		sys.exit(0)
+
+	signal.signal(signal.SIGTERM, cleanup)
+	signal.signal(signal.SIGINT, cleanup)
+	signal.signal(signal.SIGUSR1, lambda signum, frame: [emu.reset() for emu in emulators])
+
+	while True:
+		signal.pause()
+
+if __name__ == '__main__':
+	main()
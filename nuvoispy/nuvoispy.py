@@ -30,9 +30,26 @@
 import sys
 import serial
 import time
+import argparse
+import os
+import threading
+import zlib
+import json
+import subprocess
+
+import nuvopkg
 
 SER_TIMEOUT		= 0.05		# 50ms
+REPLY_TIMEOUT		= 0.25		# deadline for a complete reply packet, at most
+MIN_TIMEOUT		= 0.02		# lower bound of the RTT derived deadline
+ERASE_TIMEOUT		= 2.0		# first APROM packet, the bootloader erases first
+MAX_RETRIES		= 5
+RESET_PULSE_MS		= 10
+BOOT_DELAY		= 0.005		# from releasing reset until the bootloader listens
+LISTEN_WINDOW		= 0.29		# nuvoboot runs APROM after six idle frame gaps
+DEFAULT_BAUD		= 115200
 PACKSIZE		= 64
+CFG_LEN			= 5
 N76E003_DEVID 		= 0x3650
 
 CMD_UPDATE_APROM	= 0xa0
@@ -44,8 +61,45 @@ CMD_RUN_APROM		= 0xab
 CMD_CONNECT		= 0xae
 CMD_GET_DEVICEID 	= 0xb1
 
-seq_num = 0
-ser = 0
+# nuvoboot extensions, see nuvoboot/nuvoboot.c
+CMD_GET_CAPS		= 0xd0
+CMD_SET_BAUD		= 0xd1
+CMD_ERASE		= 0xd2
+CMD_STREAM_DATA		= 0xd3
+CMD_CRC32		= 0xd4
+CMD_WRITE		= 0xd5
+CMD_PAGE_CRCS		= 0xd6
+CMD_STREAM_LZ		= 0xd7
+CMD_READ		= 0xd8
+
+NUVOBOOT_FW_FLAG	= 0x80		# set in the CMD_GET_FWVER reply of nuvoboot
+CAP_CRC32		= 0x01
+CAP_PAGES		= 0x02		# CMD_WRITE and CMD_PAGE_CRCS
+CAP_LZ			= 0x04
+CAP_READ		= 0x08
+WRITE_LEN		= 48
+READ_LEN		= PACKSIZE - 8
+MAX_PAGE_CRCS		= 14
+
+PAGE_SIZE		= 128
+STREAM_FRAME_SIZE	= 4 + PAGE_SIZE + 2
+STREAM_ACK_SIZE		= 4
+STREAM_OK		= 0
+LZ_HEADER_SIZE		= 5
+LZ_MAX_DATA		= STREAM_FRAME_SIZE - LZ_HEADER_SIZE - 2
+FRAME_GAP		= 0.05		# the bootloader resynchronizes after this much idle time
+FAST_BAUDS		= (115200, 250000, 500000, 1000000)
+
+class NoDevice(Exception):
+	pass
+class NoResponse(Exception):
+	pass
+class ChecksumError(Exception):
+	pass
+class VerifyError(Exception):
+	pass
+class ConfigError(Exception):
+	pass
 
 def progress_bar(text, value, endvalue, bar_length=54):
 	percent = float(value) / endvalue
@@ -54,6 +108,74 @@ def progress_bar(text, value, endvalue, bar_length=54):
 
 	print("\r{0}: [{1}] {2}%".format(text, arrow + spaces, int(round(percent * 100))), end='\r')
 
+def geometry(devid):
+	"""flash size and largest LDROM of the part, the N76E003's if unknown"""
+	return nuvopkg.GEOMETRY.get(devid, nuvopkg.GEOMETRY[N76E003_DEVID])
+
+def ldrom_size(cfg, devid=N76E003_DEVID):
+	# LDSIZE: 111 no LDROM, 110 1 KB, 101 2 KB, ... up to the part's largest
+	return min((7 - (cfg[1] & 0x7)) * 1024, geometry(devid)[1])
+
+def describe_config(cfg, devid=N76E003_DEVID):
+	"""CONFIG0..4 in words, as nuvoicp prints them"""
+	wdt = cfg[4] >> 4
+	lines = [
+		"MCU Boot select:\t%s" % ("APROM" if cfg[0] & 0x80 else "LDROM"),
+		"LDROM size:\t\t%d Bytes" % ldrom_size(cfg, devid),
+		"APROM size:\t\t%d Bytes" % (geometry(devid)[0] - ldrom_size(cfg, devid)),
+		"Security lock:\t\t%s" % ("unlocked" if cfg[0] & 0x02 else "locked"),
+		"P2.0/RST pin:\t\t%s" % ("reset" if cfg[0] & 0x04 else "input"),
+		"OCD:\t\t\t%s" % ("disabled" if cfg[0] & 0x10 else "enabled"),
+		"Brown-out detect:\t%s, %s V, %s" % ("enabled" if cfg[2] & 0x80 else "disabled",
+			("4.4", "3.7", "2.7", "2.2")[(cfg[2] >> 4) & 0x3],
+			"reset" if cfg[2] & 0x04 else "interrupt only"),
+		"Watchdog:\t\t%s" % ("disabled" if wdt == 0xf else
+			"enabled, stops in idle and power-down" if wdt == 0x5 else
+			"enabled, runs in idle and power-down"),
+	]
+	return "\n".join(lines)
+
+def lz_compress(page):
+	"""tokens of a CMD_STREAM_LZ frame, see nuvoboot.c: literal runs,
+	byte fills and copies from earlier in the same page"""
+	out = bytearray()
+	lit = bytearray()
+	pos = 0
+
+	def flush():
+		while lit:
+			out.append(min(len(lit), 128) - 1)
+			out.extend(lit[:128])
+			del lit[:128]
+
+	while pos < len(page):
+		fill = 1
+		while pos + fill < len(page) and fill < 66 and page[pos + fill] == page[pos]:
+			fill += 1
+
+		copy, dist = 0, 0
+		for d in range(1, pos + 1):
+			n = 0
+			while pos + n < len(page) and n < 66 and page[pos + n] == page[pos + n - d]:
+				n += 1
+			if n > copy:
+				copy, dist = n, d
+
+		if fill >= 3 and fill >= copy:
+			flush()
+			out += bytes([0x80 | (fill - 3), page[pos]])
+			pos += fill
+		elif copy >= 3:
+			flush()
+			out += bytes([0xc0 | (copy - 3), dist])
+			pos += copy
+		else:
+			lit.append(page[pos])
+			pos += 1
+
+	flush()
+	return bytes(out)
+
 def verify_chksum(tx, rx):
 	txsum = 0
 	for i in range(len(tx)):
@@ -64,131 +186,866 @@ def verify_chksum(tx, rx):
 
 	return (rxsum == txsum)
 
-def cmd_packet(cmd):
-	global seq_num
-	seq_num = seq_num + 1
-	return bytes([cmd]) + bytes(3) + bytes([seq_num & 0xff, (seq_num >> 8) & 0xff]) + bytes(PACKSIZE-5)
+class IspSession:
+	"""One serial connection to an ISP bootloader, with its own packet
+	sequence number and link statistics."""
 
-def send_cmd(tx):
-	# todo: only have 5 retries
-	ser.write(tx)
-	tries = 0
+	def __init__(self, port, baud=DEFAULT_BAUD, exclusive=False, reset=None, reset_invert=False):
+		self.port = port
+		self.baud = baud
+		self.seq_num = 0
+		self.fast = None
+		self.readback = False
+		self.compress = False
+		self.wire_bytes = self.raw_bytes = 0
+		self.full = False
+		self.cache = None
+		self.package = None		# APROM segment of a package, with precomputed CRCs
+		self.devid = N76E003_DEVID
+		self.rtts = []
+		self.packets = 0		# sent once connected, resends and stream frames included
+		self.retries = MAX_RETRIES
+		self.timeout = None		# fixed reply deadline, else derived from the RTT
+		self.srtt = self.rttvar = None
+		self.retransmits = self.timeouts = self.checksum_errors = 0
+		self.status = "idle"
+		self.progress = (0, 1)
+		self.verbose = True
+		self.reset = reset
+		self.reset_invert = reset_invert
+		self.reset_ms = RESET_PULSE_MS
+		self.reset_cmd = None
+		self.connect_timeout = None
 
-	while True:
-		time.sleep(SER_TIMEOUT)
-		nbytes = ser.inWaiting()
+		self.ser = serial.Serial(None, baud, timeout=SER_TIMEOUT,
+					 exclusive=exclusive or None)
+		self.ser.port = port
+		# don't hold the target in reset when the port opens
+		if reset:
+			self.set_reset(False)
+		self.ser.open()
 
-		if (nbytes < PACKSIZE):
-			tries = tries + 1
-			if (tries > 5):
-#				print("Re-sending packet!")
-				ser.write(tx)
-			continue
+	def close(self):
+		self.ser.close()
 
-		rx = ser.read(PACKSIZE)
+	def log(self, msg):
+		self.status = msg
+		if self.verbose:
+			print(msg)
 
-		if (len(rx) != PACKSIZE):
-			continue
+	def set_progress(self, text, value, endvalue):
+		self.progress = (value, endvalue)
+		if self.verbose:
+			progress_bar(text, value, endvalue)
+
+	def cmd_packet(self, cmd):
+		self.seq_num = self.seq_num + 1
+		return bytes([cmd]) + bytes(3) + bytes([self.seq_num & 0xff, (self.seq_num >> 8) & 0xff]) + bytes(PACKSIZE-6)
+
+	def reply_timeout(self):
+		"""smoothed RTT plus four deviations, like TCP's retransmission timer"""
+		if self.timeout:
+			return self.timeout
+		if self.srtt is None:
+			return REPLY_TIMEOUT
+		return min(max(self.srtt + 4 * self.rttvar, MIN_TIMEOUT), REPLY_TIMEOUT)
+
+	def add_rtt(self, rtt):
+		if self.srtt is None:
+			self.srtt, self.rttvar = rtt, rtt / 2
 		else:
+			self.rttvar = 0.75 * self.rttvar + 0.25 * abs(self.srtt - rtt)
+			self.srtt = 0.875 * self.srtt + 0.125 * rtt
+
+	def send_cmd(self, tx, timeout=None, retries=None):
+		"""send a packet and return the reply, resending it up to 'retries' times;
+		slow commands pass a fixed timeout, the others use the measured RTT"""
+		ser = self.ser
+		retries = self.retries if retries is None else retries
+		bad_checksum = False
+
+		for tries in range(retries + 1):
+			if (tries > 0):
+				self.retransmits += 1
+				ser.reset_input_buffer()
+
+			# back off on every resend
+			ser.timeout = timeout or min(self.reply_timeout() * (1 << tries), REPLY_TIMEOUT)
+
+			t = time.monotonic()
+			ser.write(tx)
+			self.packets += 1
+
+			# blocks until the full reply is there or the deadline has passed
+			rx = ser.read(PACKSIZE)
+
+			if (len(rx) != PACKSIZE):
+				self.timeouts += 1
+				bad_checksum = False
+				continue
+
+			rtt = time.monotonic() - t
+			self.rtts.append(rtt)
+
+			# a late reply to an earlier packet, or a corrupted one
 			if not verify_chksum(tx, rx):
-				print("Invalid checksum received!")
-				raise ChecksumError
+				self.checksum_errors += 1
+				bad_checksum = True
+				continue
 
-			break
+			# only unambiguous samples, and none of slow commands
+			if tries == 0 and (timeout or 0) <= REPLY_TIMEOUT:
+				self.add_rtt(rtt)
 
-	return rx
+			return rx
 
-class NoDevice(Exception):
-	pass
-class ChecksumEerror(Exception):
-	pass
+		raise ChecksumError if bad_checksum else NoResponse
+
+	def set_reset(self, active):
+		level = active != self.reset_invert
+		if self.reset == "dtr":
+			self.ser.dtr = level
+		else:
+			self.ser.rts = level
+
+	def pulse_reset(self):
+		if self.reset_cmd:
+			subprocess.run(self.reset_cmd.replace("{port}", self.port), shell=True)
+		else:
+			self.set_reset(True)
+			time.sleep(self.reset_ms / 1000)
+			self.set_reset(False)
+
+	def try_connect(self):
+		cmd = self.cmd_packet(CMD_CONNECT)
+		self.ser.reset_input_buffer()
+		self.ser.write(cmd)
 
-def connect_req():
-	connected = False
-	# todo: timeout
+		rx = self.ser.read(PACKSIZE)
+		return len(rx) == PACKSIZE and verify_chksum(cmd, rx)
 
-	while not connected:
-		cmd = cmd_packet(CMD_CONNECT)
-		ser.write(cmd)
-		time.sleep(SER_TIMEOUT)
+	def connect_req(self):
+		# leave a frame gap after each try, so the bootloader resynchronizes
+		self.ser.timeout = SER_TIMEOUT + 2 * PACKSIZE * 10 / self.baud
 
-		nbytes = ser.inWaiting()
-		rx = ser.read(nbytes)
+		if self.reset or self.reset_cmd:
+			# the bootloader only listens for a moment after reset
+			for tries in range(self.retries + 1):
+				self.pulse_reset()
+				start = time.monotonic()
+				time.sleep(BOOT_DELAY)
 
-		if (nbytes != PACKSIZE):
-			continue
+				while time.monotonic() - start < LISTEN_WINDOW:
+					if self.try_connect():
+						self.log("Got valid reply %.0f ms after reset" %
+							 ((time.monotonic() - start) * 1000))
+						return
+			raise NoResponse
 
-		if verify_chksum(cmd, rx):
-				print("Got valid reply")
-				connected = True
+		self.log("Trying to connect to MCU, please press reset button")
+		deadline = self.connect_timeout and time.monotonic() + self.connect_timeout
 
-def get_deviceid():
-	rx = send_cmd(cmd_packet(CMD_GET_DEVICEID))
-	return (rx[9] << 8) + rx[8]
+		while not self.try_connect():
+			if deadline and time.monotonic() > deadline:
+				raise NoResponse
 
-def update_aprom(filename):
-	f = open(filename, "rb") #nuvoton_n76e003_sdcc/main.bin
-	data = bytes(f.read())
-	flen = f.tell()
-	ipos = 0
+		self.log("Got valid reply")
 
-	cmd = bytes([CMD_UPDATE_APROM]) + bytes(11) + bytes([flen & 0xff, (flen >> 8) & 0xff]) + bytes(2) + bytes(data[0:48])
+	def sync_packno(self):
+		self.send_cmd(self.cmd_packet(CMD_SYNC_PACKNO))
 
-	# Program first block of 48 bytes
-	send_cmd(cmd)
-	ipos += 48
+	def get_deviceid(self):
+		rx = self.send_cmd(self.cmd_packet(CMD_GET_DEVICEID))
+		return (rx[9] << 8) + rx[8]
 
-	while (ipos <= flen):
-		progress_bar("Programming APROM", ipos, flen)
-		# Program remaing blocks (56 byte)
-		if ((ipos + 56) < flen):
-			cmd = bytes(8) + bytes(data[ipos:ipos+56])
+	def identify(self):
+		self.connect_req()
+		self.sync_packno()
+		if (self.get_deviceid() == self.devid):
+			self.log('Found N76E003' if self.devid == N76E003_DEVID else
+				 'Found device 0x%04x' % self.devid)
 		else:
-			# Last block
-			cmd = bytes(8) + bytes(data[ipos:flen]) + bytes(56-(flen-ipos))
+			raise NoDevice
+
+	def read_config(self):
+		rx = self.send_cmd(self.cmd_packet(CMD_READ_CONFIG))
+		return bytes(rx[8:8 + CFG_LEN])
+
+	def update_config(self, cfg):
+		cmd = bytearray(self.cmd_packet(CMD_UPDATE_CONFIG))
+		cmd[8:16] = bytes(cfg).ljust(8, b'\xff')
+		self.send_cmd(bytes(cmd), ERASE_TIMEOUT)
+
+	def configure(self, boot=None, ldrom_kb=None, force=False):
+		"""show CONFIG and change boot select and LDROM size in place,
+		everything else is kept as it is"""
+		self.identify()
+
+		cfg = bytearray(self.read_config())
+		self.log(describe_config(cfg, self.devid))
+
+		new = bytearray(cfg)
+		if boot is not None:
+			new[0] = (new[0] & ~0x80) | (0x80 if boot == "aprom" else 0)
+		if ldrom_kb is not None:
+			new[1] = (new[1] & ~0x7) | (7 - ldrom_kb)
+
+		if new != cfg:
+			# the bootloader answering us lives in LDROM
+			if ldrom_size(new, self.devid) < ldrom_size(cfg, self.devid) and not force:
+				raise ConfigError("shrinking LDROM would cut off the running bootloader")
+			if not ldrom_size(new, self.devid) and not new[0] & 0x80:
+				raise ConfigError("cannot boot from LDROM without LDROM")
+
+			self.update_config(new)
+			if self.read_config() != new:
+				raise VerifyError
+			self.log("\nUpdated CONFIG, takes effect after the next reset:")
+			self.log(describe_config(new, self.devid))
+
+		self.run_aprom()
+
+	def update_aprom(self, data):
+		flen = len(data)
+		ipos = 0
+
+		cmd = bytes([CMD_UPDATE_APROM]) + bytes(11) + bytes([flen & 0xff, (flen >> 8) & 0xff]) + bytes(2) + bytes(data[0:48])
+
+		# Program first block of 48 bytes, the bootloader erases APROM before replying
+		self.send_cmd(cmd, ERASE_TIMEOUT)
+		ipos += 48
+
+		while (ipos < flen):
+			self.set_progress("Programming APROM", ipos, flen)
+			# Program remaing blocks (56 byte)
+			if ((ipos + 56) < flen):
+				cmd = bytes(8) + bytes(data[ipos:ipos+56])
+			else:
+				# Last block
+				cmd = bytes(8) + bytes(data[ipos:flen]) + bytes(56-(flen-ipos))
+
+			# no address in the packet, a resent one would be programmed at the next
+			# offset: a late or corrupted reply ends the update instead
+			try:
+				self.send_cmd(cmd, REPLY_TIMEOUT, retries=0)
+			except (NoResponse, ChecksumError) as e:
+				raise type(e)("at APROM offset %d, update aborted" % ipos)
+			ipos += 56
+
+		self.set_progress("Programming APROM", flen, flen)
+
+	def get_fwver(self):
+		rx = self.send_cmd(self.cmd_packet(CMD_GET_FWVER))
+		return rx[8]
+
+	def get_caps(self):
+		"""nuvoboot extensions, None for the stock bootloader"""
+		if not self.get_fwver() & NUVOBOOT_FW_FLAG:
+			return None
+
+		rx = self.send_cmd(self.cmd_packet(CMD_GET_CAPS))
+
+		return { "version": rx[8], "payload": rx[9], "window": rx[10],
+			 "bauds": [b for i, b in enumerate(FAST_BAUDS) if rx[11] & (1 << i)],
+			 "features": rx[12] }
+
+	def crc32(self, addr, length):
+		cmd = bytearray(self.cmd_packet(CMD_CRC32))
+		cmd[8:12] = addr.to_bytes(4, "little")
+		cmd[12:16] = length.to_bytes(4, "little")
+		rx = self.send_cmd(bytes(cmd), ERASE_TIMEOUT)
+		return int.from_bytes(rx[8:12], "little")
+
+	def set_baud(self, baud):
+		cmd = bytearray(self.cmd_packet(CMD_SET_BAUD))
+		cmd[8:12] = baud.to_bytes(4, "little")
+		rx = self.send_cmd(bytes(cmd))
+		if rx[8]:
+			self.log("Bootloader does not support %d baud" % baud)
+			return None
+
+		# the bootloader switches once the reply is out
+		self.ser.flush()
+		time.sleep(0.01)
+		self.ser.baudrate = baud
+		self.baud = baud
+		self.srtt = self.rttvar = None
+		self.sync_packno()
+		self.log("Switched to %d baud" % baud)
+
+		return rx[9]
+
+	def erase(self, addr, length):
+		cmd = bytearray(self.cmd_packet(CMD_ERASE))
+		cmd[8:12] = addr.to_bytes(4, "little")
+		cmd[12:16] = length.to_bytes(4, "little")
+		self.send_cmd(bytes(cmd), ERASE_TIMEOUT)
+
+	def page_crcs(self, npages):
+		crcs = []
+
+		while len(crcs) < npages:
+			n = min(npages - len(crcs), MAX_PAGE_CRCS)
+			cmd = bytearray(self.cmd_packet(CMD_PAGE_CRCS))
+			cmd[8:10] = bytes([len(crcs), n])
+			rx = self.send_cmd(bytes(cmd), ERASE_TIMEOUT)
+			crcs += [int.from_bytes(rx[8 + i * 4:12 + i * 4], "little") for i in range(n)]
+
+		return crcs
+
+	def image_crc(self, data):
+		"""of the image being flashed, which is the package's if there is one"""
+		return self.package.crc if self.package else zlib.crc32(data)
+
+	def changed_pages(self, data, cache=None):
+		"""indices of the pages that differ, from the cached copy if the
+		target still holds it, otherwise from CRCs of the target's pages"""
+		pages = [bytes(data[i:i + PAGE_SIZE]).ljust(PAGE_SIZE, b'\xff')
+			 for i in range(0, len(data), PAGE_SIZE)]
+
+		if cache is not None:
+			cached = bytes(cache[:len(data)]).ljust(len(data), b'\xff')
+			if self.crc32(0, len(data)) == zlib.crc32(cached):
+				self.log("Target matches the cached image")
+				cached = cached.ljust(len(pages) * PAGE_SIZE, b'\xff')
+				return [i for i, page in enumerate(pages)
+					if cached[i * PAGE_SIZE:(i + 1) * PAGE_SIZE] != page]
+
+		crcs = self.page_crcs(len(pages))
+		if self.package:
+			return [i for i in range(len(pages)) if crcs[i] != self.package.page_crcs[i]]
+		return [i for i, page in enumerate(pages) if crcs[i] != zlib.crc32(page)]
+
+	def write(self, addr, chunk):
+		cmd = bytearray(self.cmd_packet(CMD_WRITE))
+		cmd[8:12] = addr.to_bytes(4, "little")
+		cmd[12] = len(chunk)
+		cmd[16:16 + len(chunk)] = chunk
+		self.send_cmd(bytes(cmd))
+
+	def read(self, addr, length):
+		cmd = bytearray(self.cmd_packet(CMD_READ))
+		cmd[8:12] = addr.to_bytes(4, "little")
+		cmd[12] = length
+		rx = self.send_cmd(bytes(cmd))
+		return rx[8:8 + length]
+
+	def verify(self, data, pages=None):
+		"""read back APROM, or only the given pages, comparing each packet
+		against the image as it arrives; returns the pages that differ"""
+		if pages is None:
+			ranges = [(0, len(data))]
+		else:
+			ranges = [(i * PAGE_SIZE, min((i + 1) * PAGE_SIZE, len(data))) for i in pages]
+
+		total = sum(end - start for start, end in ranges)
+		done = 0
+		bad = []
+
+		for start, end in ranges:
+			for addr in range(start, end, READ_LEN):
+				n = min(READ_LEN, end - addr)
+				got = self.read(addr, n)
+				diff = [i for i in range(n) if got[i] != data[addr + i]]
+				if diff:
+					i = diff[0]
+					self.log("\nMismatch at 0x%04x: 0x%02x instead of 0x%02x, %d byte(s) differ in this packet" %
+						 (addr + i, got[i], data[addr + i], len(diff)))
+					for page in sorted({(addr + i) // PAGE_SIZE for i in diff}):
+						if page not in bad:
+							bad.append(page)
+				done += n
+				self.set_progress("Verifying APROM", done, total)
+
+		return bad
+
+	def update_pages(self, data, changed, window=None):
+		"""erase and reprogram only the changed pages, streamed if a window is given"""
+		pages = [bytes(data[i * PAGE_SIZE:(i + 1) * PAGE_SIZE]).ljust(PAGE_SIZE, b'\xff')
+			 for i in changed]
 
-		send_cmd(cmd)
-		ipos += 56
+		# erase runs of consecutive pages with one command each
+		start = 0
+		for i in range(1, len(changed) + 1):
+			if i == len(changed) or changed[i] != changed[i - 1] + 1:
+				self.erase(changed[start] * PAGE_SIZE, (i - start) * PAGE_SIZE)
+				start = i
 
-	progress_bar("Programming APROM", flen, flen)
+		if window:
+			self.stream_pages(changed, pages, window)
+			return
+
+		for n, (index, page) in enumerate(zip(changed, pages)):
+			for offset in range(0, PAGE_SIZE, WRITE_LEN):
+				# nothing to program in erased flash
+				chunk = page[offset:offset + WRITE_LEN]
+				if chunk != b'\xff' * len(chunk):
+					self.write(index * PAGE_SIZE + offset, chunk)
+			self.set_progress("Programming pages", n + 1, len(changed))
+
+	def stream_frame(self, index, addr, page, tokens=None):
+		if tokens is not None and len(tokens) <= LZ_MAX_DATA:
+			frame = bytearray([CMD_STREAM_LZ, index & 0xff]) + addr.to_bytes(2, "little")
+			frame += bytes([len(tokens)]) + tokens
+		else:
+			frame = bytearray([CMD_STREAM_DATA, index & 0xff]) + addr.to_bytes(2, "little") + page
+		frame += (sum(frame) & 0xffff).to_bytes(2, "little")
+
+		self.wire_bytes += len(frame)
+		self.raw_bytes += STREAM_FRAME_SIZE
+		self.ser.write(frame)
+		self.packets += 1
+
+	def stream_aprom(self, data, window):
+		"""erase, then program whole pages with up to 'window' frames in flight"""
+		pages = [bytes(data[i:i + PAGE_SIZE]).ljust(PAGE_SIZE, b'\xff')
+			 for i in range(0, len(data), PAGE_SIZE)]
+
+		self.erase(0, len(pages) * PAGE_SIZE)
+		self.stream_pages(range(len(pages)), pages, window)
+
+	def stream_pages(self, indices, pages, window):
+		"""program erased pages, sequence numbers count from the last CMD_ERASE"""
+		tokens = [lz_compress(page) for page in pages] if self.compress else [None] * len(pages)
+
+		# frame time on the wire plus programming, generously
+		self.ser.timeout = window * (STREAM_FRAME_SIZE * 10 / self.baud + 0.01) + REPLY_TIMEOUT
+		base = nxt = 0
+		tries = 0
+
+		while base < len(pages):
+			while nxt < len(pages) and nxt - base < window:
+				self.stream_frame(nxt, indices[nxt] * PAGE_SIZE, pages[nxt], tokens[nxt])
+				nxt += 1
+
+			t = time.monotonic()
+			ack = self.ser.read(STREAM_ACK_SIZE)
+
+			ok = (len(ack) == STREAM_ACK_SIZE and ack[0] == CMD_STREAM_DATA and
+			      ack[0] ^ ack[1] ^ ack[2] == ack[3])
+
+			if ok:
+				self.rtts.append(time.monotonic() - t)
+				# seq of the last programmed frame, within the window
+				acked = base + ((ack[1] - base) & 0xff)
+				if acked < nxt:
+					base = acked + 1
+					tries = 0
+
+			if not ok or ack[2] != STREAM_OK:
+				tries += 1
+				if tries > self.retries:
+					raise NoResponse
+				self.retransmits += nxt - base
+				if not ok:
+					self.timeouts += 1
+
+				# let the bootloader see a frame gap, then go back
+				time.sleep(FRAME_GAP * 1.5)
+				self.ser.reset_input_buffer()
+				nxt = base
+
+			self.set_progress("Streaming APROM", base * PAGE_SIZE, len(pages) * PAGE_SIZE)
+
+	def run_aprom(self):
+		self.ser.write(self.cmd_packet(CMD_RUN_APROM))
+		self.packets += 1
+
+	def set_low_latency(self):
+		# ASYNC_LOW_LATENCY, makes the tty layer push received bytes immediately
+		try:
+			self.ser.set_low_latency_mode(True)
+		except (AttributeError, IOError, ValueError) as e:
+			self.log("Could not set low latency mode: %s" % e)
+
+		# FTDI adapters additionally hold back bytes for up to latency_timer ms
+		sysfs = "/sys/bus/usb-serial/devices/%s/latency_timer" % os.path.basename(os.path.realpath(self.port))
+		if os.path.exists(sysfs):
+			try:
+				with open(sysfs, "w") as f:
+					f.write("1")
+			except IOError as e:
+				self.log("Could not set FTDI latency timer: %s" % e)
+
+			with open(sysfs) as f:
+				self.log("FTDI latency timer: %s ms" % f.read().strip())
+
+	def link_report(self):
+		"""link counters and round trip percentiles in ms"""
+		rtts = sorted(self.rtts)
+		ms = lambda s: round(s * 1000, 3)
+		pct = lambda p: ms(rtts[min(len(rtts) - 1, int(len(rtts) * p / 100))]) if rtts else 0
+
+		report = { "baud": self.baud, "packets": self.packets, "replies": len(rtts),
+			   "retransmits": self.retransmits, "timeouts": self.timeouts,
+			   "checksum_errors": self.checksum_errors,
+			   "reply_timeout_ms": ms(self.reply_timeout()),
+			   "rtt_ms": { "min": pct(0), "p50": pct(50), "p90": pct(90),
+				       "p99": pct(99), "max": pct(100),
+				       "avg": ms(sum(rtts) / len(rtts)) if rtts else 0 } }
+		if self.compress and self.wire_bytes:
+			report["compression"] = round(self.raw_bytes / self.wire_bytes, 2)
+		return report
+
+	def link_stats(self):
+		if not self.rtts:
+			return "no packets"
+
+		r = self.link_report()
+		rtt = r["rtt_ms"]
+
+		if "compression" in r:
+			lz = ", stream frames compressed %.2fx" % r["compression"]
+		else:
+			lz = ""
+
+		# request and reply, 10 bits per byte on the wire
+		wire = 2 * PACKSIZE * 10 / self.baud * 1000
+
+		return ("round trip time over %d replies to %d packets: min %.2f ms, p50 %.2f ms, p90 %.2f ms, "
+			"p99 %.2f ms, max %.2f ms (%.2f ms on the wire, %.2f ms turnaround); "
+			"%d retransmits, %d timeouts, %d bad checksums, reply timeout %.1f ms" %
+			(r["replies"], r["packets"], rtt["min"], rtt["p50"], rtt["p90"], rtt["p99"], rtt["max"],
+			 wire, rtt["avg"] - wire, r["retransmits"], r["timeouts"],
+			 r["checksum_errors"], r["reply_timeout_ms"]) + lz)
+
+	def program(self, data):
+		self.identify()
+
+		caps = self.get_caps()
+		crc = caps and caps["features"] & CAP_CRC32
+
+		# one round trip instead of an update if the image is already there
+		if crc and self.crc32(0, len(data)) == self.image_crc(data):
+			self.log("APROM already matches the image, skipping update")
+			self.run_aprom()
+			return
+
+		window = None
+		if caps and self.fast is not None:
+			self.log("nuvoboot protocol %d, %d byte pages, window %d" %
+				 (caps["version"], caps["payload"], caps["window"]))
+			window = caps["window"]
+			self.compress = self.compress and bool(caps["features"] & CAP_LZ)
+			if self.fast and self.fast != self.baud:
+				window = self.set_baud(self.fast) or window
+
+		changed = None
+		if caps and caps["features"] & CAP_PAGES and not self.full:
+			changed = self.changed_pages(data, self.cache)
+			npages = (len(data) + PAGE_SIZE - 1) // PAGE_SIZE
+			self.log("%d of %d pages changed" % (len(changed), npages))
+
+			# three CMD_WRITE packets per page against 56 bytes per packet
+			if not window and len(changed) * 3 > len(data) // 56:
+				changed = None
+
+		if changed is not None:
+			self.update_pages(data, changed, window)
+		elif window:
+			self.stream_aprom(data, window)
+		else:
+			if self.fast is not None:
+				self.log("No nuvoboot extensions, using the stock protocol")
+			self.update_aprom(data)
+
+		readback = caps and caps["features"] & CAP_READ
+		if self.readback and not readback:
+			self.log("Bootloader cannot read back APROM, skipping verification")
+
+		if crc and not self.readback:
+			if self.crc32(0, len(data)) == self.image_crc(data):
+				self.log("\nVerified APROM CRC-32")
+			elif not readback:
+				raise VerifyError
+			else:
+				# find out which pages are wrong and rewrite just those
+				self.log("\nAPROM CRC-32 mismatch")
+				self.readback = True
+
+		if self.readback and readback:
+			bad = self.verify(data)
+			for _ in range(MAX_RETRIES):
+				if not bad:
+					break
+				self.log("\nRewriting %d page(s)" % len(bad))
+				self.update_pages(data, bad, window)
+				bad = self.verify(data, bad)
+			if bad:
+				raise VerifyError
+			self.log("\nVerified APROM")
+
+		self.run_aprom()
+
+def print_stats(isp, ok, elapsed):
+	print(json.dumps(dict(port=isp.port, status="done" if ok else isp.status,
+			      elapsed_s=round(elapsed, 3), **isp.link_report())))
+
+def open_session(port, args):
+	isp = IspSession(port, args.baud, args.exclusive, args.reset, args.reset_invert)
+	isp.retries = args.retries
+	isp.timeout = args.timeout and args.timeout / 1000
+	isp.reset_ms = args.reset_ms
+	isp.reset_cmd = args.reset_cmd
+	isp.connect_timeout = args.connect_timeout
+	isp.fast = args.fast
+	isp.compress = args.compress
+	isp.readback = args.verify
+	isp.full = args.full
+	if args.package:
+		isp.package = args.package.get(nuvopkg.APROM)
+		isp.devid = args.package.devid or N76E003_DEVID
+	return isp
+
+class PortJob:
+	"""State of one port in parallel mode"""
+
+	def __init__(self, port):
+		self.port = port
+		self.isp = None
+		self.status = "opening"
+		self.elapsed = 0
+		self.ok = False
+
+	def line(self):
+		if not self.isp:
+			return "%-16s %s" % (self.port, self.status)
+
+		value, endvalue = self.isp.progress
+		return "%-16s %3d%%  %s" % (self.port, 100 * value // max(endvalue, 1), self.isp.status)
+
+	def run(self, data, args):
+		start = time.monotonic()
+
+		try:
+			self.isp = open_session(self.port, args)
+			self.isp.verbose = False
+
+			if args.low_latency:
+				self.isp.set_low_latency()
+
+			self.isp.program(data)
+			self.isp.status = "done"
+			self.ok = True
+
+		except NoDevice:
+			self.isp.status = "incorrect device found"
+		except ChecksumError as e:
+			self.isp.status = "bad checksum %s" % (str(e) or "after %d retries" % self.isp.retries)
+		except NoResponse as e:
+			self.isp.status = "no response %s" % (str(e) or "after %d retries" % self.isp.retries)
+		except VerifyError:
+			self.isp.status = "APROM CRC-32 mismatch after update"
+		except (serial.SerialException, OSError) as e:
+			self.status = "error: %s" % e
+
+		self.elapsed = time.monotonic() - start
+		if self.isp:
+			self.isp.close()
+
+def program_parallel(ports, data, args):
+	jobs = [PortJob(port) for port in ports]
+	threads = [threading.Thread(target=job.run, args=(data, args), daemon=True) for job in jobs]
+	tty = sys.stdout.isatty()
+	start = time.monotonic()
+
+	for t in threads:
+		t.start()
+
+	# one progress line per port, redrawn in place on a terminal
+	while tty and any(t.is_alive() for t in threads):
+		for job in jobs:
+			print("\r\033[K" + job.line())
+		time.sleep(0.2)
+		print("\033[%dA" % len(jobs), end='')
+
+	for t in threads:
+		t.join()
+
+	for job in jobs:
+		print("\r\033[K" + job.line() if tty else job.line())
+
+	ok = sum(job.ok for job in jobs)
+	print("\nSummary: %d of %d boards programmed in %.1f s" % (ok, len(jobs), time.monotonic() - start))
+	for job in jobs:
+		if job.isp:
+			print("%-16s %.1f s, %s" % (job.port, job.elapsed, job.isp.link_stats()))
+
+	if args.stats:
+		for job in jobs:
+			if job.isp:
+				print_stats(job.isp, job.ok, job.elapsed)
+
+	return ok == len(jobs)
+
+def configure(ports, args):
+	"""CONFIG is a single packet, so boards are handled one after the other"""
+	ok = 0
+
+	for port in ports:
+		isp = open_session(port, args)
+		if len(ports) > 1:
+			print("%s:" % port)
+
+		try:
+			isp.configure(args.boot, args.ldrom_size, args.force)
+			ok += 1
+		except NoDevice:
+			print("Incorrect device found")
+		except ChecksumError:
+			print("Bad checksums from MCU after %d retries" % isp.retries)
+		except NoResponse:
+			print("No response from MCU after %d retries" % isp.retries)
+		except VerifyError:
+			print("CONFIG readback mismatch after update")
+		except ConfigError as e:
+			print("Refusing to update CONFIG: %s" % e)
+
+		isp.close()
+
+	return ok == len(ports)
 
 def main():
-	global ser
+	parser = argparse.ArgumentParser(description="ISP-over-UART programmer for N76E003 boards")
+	parser.add_argument("filename", nargs="?",
+			    help="binary or nuvopkg.py package to write to APROM, left out with -C, "
+			    "--boot and --ldrom-size")
+	parser.add_argument("ports", nargs="*",
+			    help="serial port(s), several ports are programmed in parallel (default: /dev/ttyUSB0)")
+	parser.add_argument("-b", "--baud", type=int, default=DEFAULT_BAUD,
+			    help="baud rate, must match the bootloader (default: %d)" % DEFAULT_BAUD)
+	parser.add_argument("-l", "--low-latency", action="store_true",
+			    help="set ASYNC_LOW_LATENCY and a 1 ms FTDI latency timer")
+	parser.add_argument("-x", "--exclusive", action="store_true",
+			    help="open the port(s) for exclusive access")
+	parser.add_argument("-c", "--cache", metavar="FILE",
+			    help="copy of what was last written to the board; if the target still "
+			    "matches it, changed pages are found without asking the bootloader, "
+			    "and it is updated after programming (single port only)")
+	parser.add_argument("--image-cache", metavar="DIR", default=os.environ.get("NUVOPROG_CACHE"),
+			    help="keep the image prepared in this local cache, shared with nuvoicp "
+			    "(default: $NUVOPROG_CACHE, if set)")
+	parser.add_argument("--full", action="store_true",
+			    help="always rewrite the whole image, even if the bootloader can update single pages")
+	parser.add_argument("-f", "--fast", action="store_true",
+			    help="stream whole pages if the bootloader is nuvoboot")
+	parser.add_argument("--fast-baud", type=int, metavar="BAUD",
+			    help="switch to BAUD (250000, 500000 or 1000000) for streaming, implies -f")
+	parser.add_argument("-v", "--verify", action="store_true",
+			    help="read APROM back after programming and rewrite pages that differ, "
+			    "if the bootloader is nuvoboot")
+	parser.add_argument("-z", "--compress", action="store_true",
+			    help="compress stream frames if the bootloader is nuvoboot, implies -f")
+	parser.add_argument("-r", "--reset", choices=("dtr", "rts"),
+			    help="reset the target through this adapter line instead of waiting "
+			    "for the reset button")
+	parser.add_argument("--reset-invert", action="store_true",
+			    help="the target is held in reset while the line is deasserted, "
+			    "not while it is asserted")
+	parser.add_argument("--reset-ms", type=float, default=RESET_PULSE_MS, metavar="MS",
+			    help="reset pulse width (default: %d ms)" % RESET_PULSE_MS)
+	parser.add_argument("--reset-cmd", metavar="CMD",
+			    help="shell command that resets the target, {port} is replaced "
+			    "by the serial port")
+	parser.add_argument("--connect-timeout", type=float, metavar="S",
+			    help="give up if the reset button isn't pressed within S seconds "
+			    "(default: wait forever)")
+	parser.add_argument("--retries", type=int, default=MAX_RETRIES, metavar="N",
+			    help="resend a packet at most N times (default: %d)" % MAX_RETRIES)
+	parser.add_argument("--timeout", type=float, metavar="MS",
+			    help="fixed reply timeout, instead of one derived from the measured "
+			    "round trip time")
+	parser.add_argument("-s", "--stats", action="store_true",
+			    help="print link statistics as JSON lines at the end")
+	parser.add_argument("-C", "--show-config", action="store_true",
+			    help="only show the CONFIG bytes, don't program APROM")
+	parser.add_argument("--boot", choices=("aprom", "ldrom"),
+			    help="set where the MCU boots from, instead of programming APROM")
+	parser.add_argument("--ldrom-size", type=int, choices=range(5), metavar="KB",
+			    help="set the LDROM size (0-4 KB), instead of programming APROM")
+	parser.add_argument("--force", action="store_true",
+			    help="allow --ldrom-size to shrink the LDROM the bootloader runs from")
+	args = parser.parse_args()
+	args.package = None
 
-	if (len(sys.argv) < 2):
-		print("Usage: ./nuvoispy.py filename.bin [/dev/ttyUSBx]")
-		exit()
+	# None: no streaming, 0: at the current baud rate
+	args.fast = args.fast_baud or (0 if args.fast or args.compress else None)
 
-	if (len(sys.argv) < 3):
-		port = "/dev/ttyUSB0"
-	else:
-		port = sys.argv[2]
+	if args.show_config or args.boot or args.ldrom_size is not None:
+		# no image, every positional argument is a port
+		ports = ([args.filename] if args.filename else []) + args.ports
+		return configure(ports or ["/dev/ttyUSB0"], args)
 
-	ser = serial.Serial(port, 115200, timeout=SER_TIMEOUT)
+	if not args.filename:
+		parser.error("the following arguments are required: filename")
+	args.ports = args.ports or ["/dev/ttyUSB0"]
 
-	if (not ser.isOpen()):
-		return
+	if args.image_cache:
+		try:
+			args.package = nuvopkg.cached(args.image_cache, args.filename)
+		except OSError as e:
+			print("Image cache %s: %s, loading directly" % (args.image_cache, e))
 
-	print("Trying to connect to MCU, please press reset button")
-	connect_req()
-	send_cmd(cmd_packet(CMD_SYNC_PACKNO))
-	if (get_deviceid() == N76E003_DEVID):
-		print('Found N76E003')
+	if not args.package and nuvopkg.is_package(args.filename):
+		args.package = nuvopkg.Package(args.filename)
+
+	if args.package:
+		if not args.package.get(nuvopkg.APROM):
+			parser.error("%s has no APROM segment" % args.filename)
+		if len(args.package.segments) > 1:
+			print("Only APROM is updated over ISP, ignoring the other segments")
+		data = bytes(args.package.get(nuvopkg.APROM).data)
 	else:
-		raise NoDevice
+		with open(args.filename, "rb") as f:
+			data = f.read()
 
-	update_aprom(sys.argv[1])
-	ser.write(cmd_packet(CMD_RUN_APROM))
-	print("\nDone.")
+	if (len(args.ports) > 1):
+		return program_parallel(args.ports, data, args)
 
-	ser.close()
+	isp = open_session(args.ports[0], args)
+	start = time.monotonic()
+	ok = False
+
+	if args.cache and os.path.exists(args.cache):
+		with open(args.cache, "rb") as f:
+			isp.cache = f.read()
 
-if __name__ == '__main__':
 	try:
-		main()
+		if args.low_latency:
+			isp.set_low_latency()
+
+		isp.program(data)
+		print("\nDone.")
+
+		if args.cache:
+			with open(args.cache + ".tmp", "wb") as f:
+				f.write(data)
+			os.replace(args.cache + ".tmp", args.cache)
+
+		print("Link: " + isp.link_stats())
+		ok = True
 
 	except NoDevice:
+		isp.status = "incorrect device found"
 		print("Incorrect device found")
 
-	ser.close()
+	except ChecksumError as e:
+		isp.status = "bad checksum %s" % (str(e) or "after %d retries" % isp.retries)
+		print("\nBad checksum from MCU %s" % (str(e) or "after %d retries" % isp.retries))
+
+	except NoResponse as e:
+		isp.status = "no response %s" % (str(e) or "after %d retries" % isp.retries)
+		print("\nNo response from MCU %s" % (str(e) or "after %d retries" % isp.retries))
 
+	except VerifyError:
+		isp.status = "APROM CRC-32 mismatch after update"
+		print("\nAPROM CRC-32 mismatch after update")
+
+	if args.stats:
+		print_stats(isp, ok, time.monotonic() - start)
+
+	isp.close()
+	return ok
+
+if __name__ == '__main__':
+	sys.exit(not main())
@@ -0,0 +1,317 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+
+# nuvopkg - firmware packages for nuvoispy and nuvoicp
+# converts .bin/.ihx images into one file with the target device ID, the
+# APROM/LDROM/CONFIG segments and their CRC-32s, per page and as a whole
+#
+# Copyright (c) 2021 Steve Markgraf <steve@steve-m.de>
+#
+# Permission is hereby granted, free of charge, to any person obtaining
+# a copy of this software and associated documentation files (the
+# "Software"), to deal in the Software without restriction, including
+# without limitation the rights to use, copy, modify, merge, publish,
+# distribute, sublicense, and/or sell copies of the Software, and to
+# permit persons to whom the Software is furnished to do so, subject to
+# the following conditions:
+#
+# The above copyright notice and this permission notice shall be included
+# in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+# EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+# MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+# IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+# CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+# TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+# SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+# File layout, all little-endian, see also struct pkg_header in nuvoicp.h:
+#
+#   0  header      "NVPK", version, device ID (0: any), page size,
+#                  number of segments, CRC-32 of all segment data
+#  32  segments    region, length, data offset, hash offset, CRC-32
+#      per segment the CRC-32 of every page (padded with 0xff, as the
+#      nuvoboot CMD_PAGE_CRCS reply), then the data at a page boundary
+#
+# Nothing has to be parsed or hashed to program a package: the data can
+# be used in place from a read-only mapping, and the CRCs are the ones
+# nuvoboot reports, so comparing against the target is a table lookup.
+
+import os
+import sys
+import mmap
+import zlib
+import struct
+import argparse
+
+MAGIC			= b'NVPK'
+VERSION			= 1
+HEADER			= struct.Struct('<4sHHHHI12x')
+SEGMENT			= struct.Struct('<IIIII12x')
+PAGE_SIZE		= 128
+
+APROM			= 0
+LDROM			= 1
+CONFIG			= 2
+REGION_NAMES		= ("aprom", "ldrom", "config")
+
+# device IDs of nuvoicp/devices.c
+DEVICES = {
+	"N76E003":	0x3650,
+	"MS51FB9AE":	0x4b21,
+	"MS51XB9AE":	0x4b21,
+	"MS51XB9BE":	0x4b21,
+	"MS51FC0AE":	0x4c21,
+	"MS51XC0BE":	0x4c21,
+}
+
+# flash size and largest LDROM of each device ID, also from nuvoicp/devices.c
+GEOMETRY = {
+	0x3650:		(18 * 1024, 4 * 1024),
+	0x4b21:		(16 * 1024, 4 * 1024),
+	0x4c21:		(32 * 1024, 4 * 1024),
+}
+
+class PackageError(Exception):
+	pass
+
+class Segment:
+	def __init__(self, region, data, crc, page_crcs):
+		self.region = region
+		self.data = data
+		self.crc = crc
+		self.page_crcs = page_crcs
+
+class Package:
+	"""A package mapped read-only, the segment data are views of the mapping"""
+
+	def __init__(self, filename):
+		with open(filename, "rb") as f:
+			self.map = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+
+		buf = memoryview(self.map)
+		if len(buf) < HEADER.size:
+			raise PackageError("%s: too short" % filename)
+
+		magic, version, self.devid, self.page_size, nsegs, self.digest = HEADER.unpack_from(buf)
+		if magic != MAGIC or version != VERSION:
+			raise PackageError("%s: not a version %d package" % (filename, VERSION))
+
+		self.segments = {}
+		for i in range(nsegs):
+			region, length, data_off, hash_off, crc = \
+				SEGMENT.unpack_from(buf, HEADER.size + i * SEGMENT.size)
+			npages = (length + self.page_size - 1) // self.page_size
+			if data_off + length > len(buf) or hash_off + npages * 4 > len(buf):
+				raise PackageError("%s: truncated" % filename)
+
+			self.segments[region] = Segment(region, buf[data_off:data_off + length], crc,
+							buf[hash_off:hash_off + npages * 4].cast('I'))
+
+	def get(self, region):
+		return self.segments.get(region)
+
+	def check(self):
+		"""recompute all CRCs, for 'nuvopkg.py info', not needed to program"""
+		digest = 0
+		for seg in self.segments.values():
+			pages = [page_crc(seg.data[i:i + self.page_size], self.page_size)
+				 for i in range(0, len(seg.data), self.page_size)]
+			if zlib.crc32(seg.data) != seg.crc or pages != list(seg.page_crcs):
+				return False
+			digest = zlib.crc32(seg.data, digest)
+
+		return digest == self.digest
+
+def is_package(filename):
+	with open(filename, "rb") as f:
+		return f.read(len(MAGIC)) == MAGIC
+
+def page_crc(page, page_size=PAGE_SIZE):
+	return zlib.crc32(bytes(page).ljust(page_size, b'\xff'))
+
+def read_ihx(f):
+	"""Intel HEX as written by sdcc, gaps filled with 0xff"""
+	data = bytearray()
+	base = 0
+
+	for lineno, line in enumerate(f, 1):
+		line = line.strip()
+		if not line:
+			continue
+		if not line.startswith(':'):
+			raise PackageError("line %d: not Intel HEX" % lineno)
+
+		rec = bytes.fromhex(line[1:])
+		if len(rec) < 5 or len(rec) != rec[0] + 5 or sum(rec) & 0xff:
+			raise PackageError("line %d: bad record" % lineno)
+
+		rtype, addr, payload = rec[3], base + ((rec[1] << 8) | rec[2]), rec[4:-1]
+		if rtype == 0:
+			if len(data) < addr + len(payload):
+				data.extend(b'\xff' * (addr + len(payload) - len(data)))
+			data[addr:addr + len(payload)] = payload
+		elif rtype == 1:
+			break
+		elif rtype == 2:
+			base = int.from_bytes(payload, "big") << 4
+		elif rtype == 4:
+			base = int.from_bytes(payload, "big") << 16
+
+	return bytes(data)
+
+def read_image(filename):
+	if filename.lower().endswith((".ihx", ".hex")):
+		with open(filename, "r") as f:
+			return read_ihx(f)
+
+	with open(filename, "rb") as f:
+		return f.read()
+
+def build(segments, devid=0, page_size=PAGE_SIZE):
+	"""segments: {region: bytes}, returns the package"""
+	regions = sorted(segments)
+	offset = HEADER.size + len(regions) * SEGMENT.size
+	table = b''
+	body = b''
+	digest = 0
+
+	for region in regions:
+		data = segments[region]
+		hashes = b''.join(struct.pack('<I', page_crc(data[i:i + page_size], page_size))
+				  for i in range(0, len(data), page_size))
+		body += b'\xff' * (-(offset + len(body)) % 4)
+		hash_off = offset + len(body)
+		body += hashes
+
+		# data at a page boundary, so that it can be used in place
+		pad = -(offset + len(body)) % page_size
+		body += b'\xff' * pad
+		data_off = offset + len(body)
+		body += data
+
+		table += SEGMENT.pack(region, len(data), data_off, hash_off, zlib.crc32(data))
+		digest = zlib.crc32(data, digest)
+
+	return HEADER.pack(MAGIC, VERSION, devid, page_size, len(regions), digest) + table + body
+
+def fnv1a64(data, h=0xcbf29ce484222325):
+	for b in data:
+		h = ((h ^ b) * 0x100000001b3) & 0xffffffffffffffff
+	return h
+
+def cache_key(region, filename):
+	path = os.path.realpath(filename)
+	st = os.stat(path)
+	return "%s %s %d %d %d\n" % (region, path, st.st_size, st.st_mtime_ns, st.st_ino)
+
+def publish(path, data=None, link=None, mode=0o644):
+	"""written to a temporary name and renamed, never seen half-written"""
+	tmp = "%s.tmp.%d" % (path, os.getpid())
+	try:
+		if link:
+			os.symlink(link, tmp)
+		else:
+			fd = os.open(tmp, os.O_WRONLY | os.O_CREAT | os.O_TRUNC, mode)
+			with os.fdopen(fd, "wb") as f:
+				f.write(data)
+				f.flush()
+				os.fsync(f.fileno())
+		os.replace(tmp, path)
+	finally:
+		if os.path.lexists(tmp):
+			os.unlink(tmp)
+
+def cached(cache_dir, aprom=None, ldrom=None):
+	"""the package of the images from the cache shared with nuvoicp (see
+	nuvoicp/cache.c), prepared and published on a miss"""
+	key = (cache_key("aprom", aprom) if aprom else "") + (cache_key("ldrom", ldrom) if ldrom else "")
+	index = os.path.join(cache_dir, "index", "%016x" % fnv1a64(key.encode()))
+
+	try:
+		return Package(index)
+	except (OSError, PackageError):
+		pass
+
+	if aprom and is_package(aprom):
+		with open(aprom, "rb") as f:
+			data = f.read()
+	else:
+		segments = {}
+		if aprom:
+			segments[APROM] = read_image(aprom)
+		if ldrom:
+			segments[LDROM] = read_image(ldrom)
+		data = build(segments)
+
+	name = "%016x.nvp" % fnv1a64(data)
+	for d in ("objects", "index"):
+		os.makedirs(os.path.join(cache_dir, d), exist_ok=True)
+	if not os.path.exists(os.path.join(cache_dir, "objects", name)):
+		publish(os.path.join(cache_dir, "objects", name), data, mode=0o444)
+	publish(index, link=os.path.join("..", "objects", name))
+
+	return Package(index)
+
+def parse_device(name):
+	if name.upper() in DEVICES:
+		return DEVICES[name.upper()]
+	try:
+		return int(name, 0)
+	except ValueError:
+		raise argparse.ArgumentTypeError("unknown device: %s" % name)
+
+def info(filename):
+	pkg = Package(filename)
+	names = sorted(set(n for n, d in DEVICES.items() if d == pkg.devid))
+	print("Device:\t\t0x%04x %s" % (pkg.devid, "/".join(names) if pkg.devid else "(any)"))
+	print("Digest:\t\t0x%08x" % pkg.digest)
+
+	for seg in pkg.segments.values():
+		print("%-8s\t%d bytes, %d pages, CRC-32 0x%08x" %
+		      (REGION_NAMES[seg.region].upper() if seg.region < len(REGION_NAMES) else seg.region,
+		       len(seg.data), len(seg.page_crcs), seg.crc))
+
+	ok = pkg.check()
+	print("CRCs:\t\t%s" % ("ok" if ok else "MISMATCH"))
+	return ok
+
+def main():
+	parser = argparse.ArgumentParser(description="Build and inspect nuvoispy/nuvoicp firmware packages")
+	sub = parser.add_subparsers(dest="cmd", required=True)
+
+	p = sub.add_parser("build", help="convert .bin/.ihx images into a package")
+	p.add_argument("output", help="package to write")
+	p.add_argument("-a", "--aprom", metavar="FILE", help="APROM image, .bin or .ihx")
+	p.add_argument("-l", "--ldrom", metavar="FILE", help="LDROM image, .bin or .ihx")
+	p.add_argument("-c", "--config", metavar="HEX", help="CONFIG0..4, e.g. 7ffbffffff")
+	p.add_argument("-d", "--device", type=parse_device, default=DEVICES["N76E003"],
+		       help="part name or device ID, 0 for any (default: N76E003)")
+
+	p = sub.add_parser("info", help="show a package and check its CRCs")
+	p.add_argument("package")
+
+	args = parser.parse_args()
+
+	if args.cmd == "info":
+		return info(args.package)
+
+	segments = {}
+	if args.aprom:
+		segments[APROM] = read_image(args.aprom)
+	if args.ldrom:
+		segments[LDROM] = read_image(args.ldrom)
+	if args.config:
+		segments[CONFIG] = bytes.fromhex(args.config)
+		if len(segments[CONFIG]) != 5:
+			parser.error("CONFIG is 5 bytes")
+	if not segments:
+		parser.error("nothing to package")
+
+	publish(args.output, build(segments, args.device))
+
+	return info(args.output)
+
+if __name__ == '__main__':
+	sys.exit(not main())